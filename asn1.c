@@ -1,42 +1,55 @@
 #include "asn1.h"
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-int asn1_cmp_oids(asn1_oid_t a, asn1_oid_t b) {
-    for (int j = 0; j < a.len && j < b.len; j++) {
-        if (a.b[j] < b.b[j]) {
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define ASN1_SIMD
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define ASN1_SIMD
+#endif
+
+int asn1_cmp_oids(const asn1_oid_t *a, const asn1_oid_t *b) {
+    const uint32_t *x = asn1_oid_arcs(a), *y = asn1_oid_arcs(b);
+
+    for (int j = 0; j < a->len && j < b->len; j++) {
+        if (x[j] < y[j]) {
             return -1;
         }
 
-        if (a.b[j] > b.b[j]) {
+        if (x[j] > y[j]) {
             return 1;
         }
     }
 
-    if (a.len == b.len) {
+    if (a->len == b->len) {
         return 0;
     }
 
-    if (a.len < b.len) {
+    if (a->len < b->len) {
         return -1;
     }
 
     return 1;
 }
 
-int asn1_oid_has_prefix(asn1_oid_t a, asn1_oid_t b) {
-    for (int j = 0; j < a.len && j < b.len; j++) {
-        if (a.b[j] != b.b[j]) {
-            return 0;
-        }
-    }
+int asn1_oid_has_prefix(const asn1_oid_t *a, const asn1_oid_t *b) {
+    const uint32_t *x = asn1_oid_arcs(a), *y = asn1_oid_arcs(b);
 
-    if (a.len < b.len) {
+    if (a->len < b->len) {
         return 0;
     }
 
+    for (int j = 0; j < b->len; j++) {
+        if (x[j] != y[j]) {
+            return 0;
+        }
+    }
+
     return 1;
 }
 
@@ -50,52 +63,197 @@ void asn1_set_error(asn1_error_t *s, int p, const char *m) {
     s->message = m;
 }
 
+#define ARENA_ALIGN 16
+
+struct asn1_arena_chunk {
+    asn1_arena_chunk_t *next;
+};
+
+static _Thread_local asn1_alloc_stats_t _stats;
+
+asn1_alloc_stats_t *asn1_alloc_stats(void) {
+    return &_stats;
+}
+
+static int _align(int n) {
+    return (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+void *asn1_alloc(asn1_arena_t *a, int n) {
+    if (a == NULL) {
+        _stats.mallocs++;
+        return malloc(n);
+    }
+
+    _stats.arena_allocs++;
+
+    n = _align(n);
+
+    if (a->len + n <= a->cap) {
+        void *p = a->b + a->len;
+        a->len += n;
+        return p;
+    }
+
+    int h = _align(sizeof(asn1_arena_chunk_t));
+
+    _stats.mallocs++;
+    asn1_arena_chunk_t *c = malloc(h + n);
+    if (c == NULL) {
+        return NULL;
+    }
+
+    c->next = a->spill;
+    a->spill = c;
+    a->spilled += n;
+
+    return (char *)c + h;
+}
+
+void *asn1_realloc(asn1_arena_t *a, void *p, int old, int n) {
+    if (a == NULL) {
+        _stats.mallocs++;
+        return realloc(p, n);
+    }
+
+    // the last allocation grows in place
+    if (p != NULL && (char *)p + _align(old) == a->b + a->len) {
+        int st = (char *)p - a->b;
+
+        if (st + _align(n) <= a->cap) {
+            _stats.arena_allocs++;
+            a->len = st + _align(n);
+            return p;
+        }
+    }
+
+    void *q = asn1_alloc(a, n);
+    if (q != NULL && p != NULL && old != 0) {
+        memcpy(q, p, old < n ? old : n);
+    }
+
+    return q;
+}
+
+void asn1_release(asn1_arena_t *a, void *p) {
+    if (a != NULL || p == NULL) {
+        return;
+    }
+
+    _stats.frees++;
+    free(p);
+}
+
+int asn1_arena_init(asn1_arena_t *a, int cap) {
+    *a = (asn1_arena_t){0};
+
+    a->b = asn1_alloc(NULL, cap);
+    if (a->b == NULL) {
+        return -1;
+    }
+
+    a->cap = cap;
+
+    return 0;
+}
+
+static void _free_spill(asn1_arena_t *a) {
+    while (a->spill) {
+        asn1_arena_chunk_t *c = a->spill;
+        a->spill = c->next;
+
+        asn1_release(NULL, c);
+    }
+}
+
+void asn1_arena_reset(asn1_arena_t *a) {
+    _stats.arena_resets++;
+
+    a->len = 0;
+
+    if (a->spill == NULL) {
+        return;
+    }
+
+    _free_spill(a);
+
+    int cap = a->cap + a->spilled;
+    a->spilled = 0;
+
+    asn1_release(NULL, a->b);
+
+    a->b = asn1_alloc(NULL, cap);
+    a->cap = a->b ? cap : 0;
+}
+
+void asn1_arena_free(asn1_arena_t *a) {
+    _free_spill(a);
+
+    asn1_release(NULL, a->b);
+
+    *a = (asn1_arena_t){0};
+}
+
 void asn1_free_oid(asn1_oid_t *id) {
-    if (id->b) {
-        free(id->b);
-        id->b = NULL;
+    if (id->len > ASN1_OID_INLINE) {
+        asn1_release(NULL, id->ext);
     }
+    id->ext = NULL;
     id->len = 0;
 }
 
 void asn1_free_str(asn1_str_t *s) {
     if (s->b) {
-        free(s->b);
+        asn1_release(NULL, s->b);
         s->b = NULL;
     }
     s->len = 0;
 }
 
-asn1_oid_t asn1_crt_oid(const int *id, int l) {
+asn1_oid_t asn1_crt_oid(const uint32_t *id, int l) {
+    return asn1_arena_crt_oid(NULL, id, l);
+}
+
+asn1_oid_t *asn1_new_oid(const uint32_t *id, int l) {
+    return asn1_arena_new_oid(NULL, id, l);
+}
+
+asn1_str_t *asn1_new_str(const char *msg, int l) {
+    return asn1_arena_new_str(NULL, msg, l);
+}
+
+asn1_oid_t asn1_arena_crt_oid(asn1_arena_t *a, const uint32_t *id, int l) {
     asn1_oid_t v;
 
     v.len = l;
-    v.b = malloc(l * sizeof(int));
-    memcpy(v.b, id, l * sizeof(int));
+    v.ext = NULL;
+    if (l > ASN1_OID_INLINE) {
+        v.ext = asn1_alloc(a, l * sizeof(uint32_t));
+    }
+    memcpy(asn1_oid_arcs(&v), id, l * sizeof(uint32_t));
 
     return v;
 }
 
-asn1_oid_t *asn1_new_oid(const int *id, int l) {
-    asn1_oid_t *v = malloc(sizeof(*v));
+asn1_oid_t *asn1_arena_new_oid(asn1_arena_t *a, const uint32_t *id, int l) {
+    asn1_oid_t *v = asn1_alloc(a, sizeof(*v));
 
-    v->len = l;
-    v->b = malloc(l * sizeof(int));
-    memcpy(v->b, id, l * sizeof(int));
+    *v = asn1_arena_crt_oid(a, id, l);
 
     return v;
 }
 
-inline asn1_str_t *asn1_new_str(const char *msg, int l) {
+asn1_str_t *asn1_arena_new_str(asn1_arena_t *a, const char *msg, int l) {
     if (l == 0) {
         l = strlen(msg);
     }
 
-    asn1_str_t *v = malloc(sizeof(*v));
+    asn1_str_t *v = asn1_alloc(a, sizeof(*v));
 
     v->len = l;
-    v->b = malloc(l + 1);
-    memcpy(v->b, msg, l + 1);
+    v->b = asn1_alloc(a, l + 1);
+    memcpy(v->b, msg, l);
+    v->b[l] = '\0';
 
     return v;
 }
@@ -174,7 +332,36 @@ int asn1_dec_long(const char *b, int *i, int l, long long *val) {
     return 0;
 }
 
+// asn1_dec_uint takes up to 8 bytes of value, 9 if the first is 0x00
+int asn1_dec_uint(const char *b, int *i, int l, unsigned long long *val) {
+    if (*i >= l) {
+        return -1;
+    }
+
+    int n = b[(*i)++];
+
+    if (n < 0 || *i + n > l || n > 9 || (n == 9 && b[*i] != 0)) {
+        return -1;
+    }
+
+    unsigned long long res = 0;
+
+    for (int j = 0; j < n; j++) {
+        res = res << 8 | (unsigned char)b[(*i)++];
+    }
+
+    if (val) {
+        *val = res;
+    }
+
+    return 0;
+}
+
 int asn1_dec_string(const char *b, int *i, int l, asn1_str_t *val) {
+    return asn1_arena_dec_string(NULL, b, i, l, val);
+}
+
+int asn1_arena_dec_string(asn1_arena_t *a, const char *b, int *i, int l, asn1_str_t *val) {
     int n = asn1_dec_length(b, i, l);
     if (n < 0) {
         return -1;
@@ -186,7 +373,7 @@ int asn1_dec_string(const char *b, int *i, int l, asn1_str_t *val) {
     if (val) {
         val->len = n;
 
-        val->b = realloc(val->b, n + 1);
+        val->b = asn1_realloc(a, val->b, 0, n + 1);
         memcpy(val->b, b + *i, n);
         val->b[n] = '\0';
     }
@@ -196,274 +383,1095 @@ int asn1_dec_string(const char *b, int *i, int l, asn1_str_t *val) {
     return 0;
 }
 
-int asn1_dec_oid(const char *b, int *i, int l, asn1_oid_t *id) {
-    int n = asn1_dec_length(b, i, l);
-    if (n < 0) {
-        return -1;
-    }
-    if (*i + n > l) {
-        return -1;
-    }
-    if (n == 0) {
-        return 0;
-    }
+// OID sub-identifiers (arcs after the first two) codec.
+// Scalar versions are the reference, SIMD ones are used if compiled in and
+// enabled (asn1_set_simd).
+
+static int _simd = 1;  // read by every thread, see asn1_set_simd
 
-    id->b = realloc(id->b, (n + 1) * sizeof(int));
-    id->len = 2;
+void asn1_set_simd(int on) {
+    _simd = on;
+}
 
-    id->b[0] = b[*i] / 40;
-    id->b[1] = b[(*i)++] % 40;
+static int _dec_sub_scalar(const char *b, int n, uint32_t *id, int cap) {
+    int len = 0;
 
-    int buf = 0;
-    for (int j = 1; j < n; j++) {
-        int q = b[(*i)++];
+    uint32_t buf = 0;
+    for (int j = 0; j < n; j++) {
+        int q = (unsigned char)b[j];
 
         buf = buf << 7 | (q & 0x7f);
 
         if ((q & 0x80) == 0) {
-            id->b[id->len++] = buf;
+            if (len == cap) {
+                return -1;
+            }
+
+            id[len++] = buf;
             buf = 0;
         }
     }
 
-    return 0;
+    return len;
 }
 
-int asn1_dec_sequence(const char *b, int *i, int l, int (*c)(const char *b, int *i, int l, int tp, void *arg), void *arg) {
-    if (*i >= l) {
-        return -1;
-    }
-
-    int tp = (int)b[(*i)++] & 0xff;
-
-    int rl = asn1_dec_length(b, i, l);
-    if (rl < 0) {
-        return -1;
+static int _sub_len1(uint32_t q) {
+    if (q < 0x80) {
+        return 1;
+    } else if (q < 0x4000) {
+        return 2;
+    } else if (q < 0x200000) {
+        return 3;
+    } else if (q < 0x10000000) {
+        return 4;
     }
 
-    return c(b, i, *i + rl, tp, arg);
+    return 5;
 }
 
-int _grow(char **buf, int *i, int *l, int s) {
-    if (*i + s <= *l) {
-        return 0;
-    }
+static int _sub_len_scalar(const uint32_t *a, int n) {
+    int len = 0;
 
-    if (*l == 0) {
-        *l = 20;
-    } else if (*l < 1000) {
-        *l *= 2;
-    } else {
-        *l += *l / 4;
-    }
-
-    *buf = realloc(*buf, *l);
-    if (*buf == NULL) {
-        return -1;
+    for (int j = 0; j < n; j++) {
+        len += _sub_len1(a[j]);
     }
 
-    return 0;
+    return len;
 }
 
-static int _len_size(int l) {
-    if (l < 0x80) {
+static int _enc_sub1(char *b, uint32_t q) {
+    if (q < 0x80) {
+        b[0] = q;
         return 1;
     }
 
-    int s = 2;
+    int n = _sub_len1(q);
 
-    for (unsigned q = l >> 8; q != 0; q >>= 8) {
-        s++;
+    for (int j = 0; j < n; j++) {
+        b[j] = (q >> (7 * (n - 1 - j))) | 0x80;
     }
 
-    return s;
+    b[n - 1] &= 0x7f;
+
+    return n;
 }
 
-static void _enc_len(char *buf, int *i, int len) {
-    if (len < 0x80) {
-        buf[(*i)++] = len;
-        return;
-    }
+static int _enc_sub_scalar(char *b, const uint32_t *a, int n) {
+    int k = 0;
 
-    int n = 1;
-    for (unsigned q = len >> 8; q != 0; q >>= 8) {
-        n++;
+    for (int j = 0; j < n; j++) {
+        k += _enc_sub1(b + k, a[j]);
     }
 
-    buf[(*i)++] = n | ASN1_LONGLEN;
+    return k;
+}
+
+// _renc_sub writes arcs backwards so that they end at b, returns bytes written
+static int _renc_sub_scalar(char *b, const uint32_t *a, int n) {
+    int k = 0;
 
     for (int j = n - 1; j >= 0; j--) {
-        buf[(*i)++] = len >> (8 * j);
+        k += _sub_len1(a[j]);
+        _enc_sub1(b - k, a[j]);
     }
+
+    return k;
 }
 
-int asn1_enc_null(char **buf, int *i, int *l, int tp) {
-    int r = _grow(buf, i, l, 2);
-    if (r) {
-        return -1;
-    }
+#ifdef ASN1_SIMD
 
-    (*buf)[(*i)++] = tp;
-    (*buf)[(*i)++] = 0;
+// continuation bits of 32 bytes
+static unsigned _cont_mask(const char *b) {
+#if defined(__AVX2__)
+    return _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)b));
+#else
+    unsigned lo = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)b));
+    unsigned hi = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(b + 16)));
 
-    return 0;
+    return lo | hi << 16;
+#endif
 }
 
-int asn1_enc_int(char **buf, int *i, int *l, int tp, int val) {
-    int n = 1;
-    for (unsigned q = val >> 8; q != 0; q >>= 8) {
-        n++;
-    }
-
-    int r = _grow(buf, i, l, 2 + n);
-    if (r) {
-        return -1;
-    }
-
-    (*buf)[(*i)++] = tp;
-    (*buf)[(*i)++] = n;
+// 16 one byte arcs
+static void _widen16(const char *b, uint32_t *id) {
+    __m128i z = _mm_setzero_si128();
+    __m128i v = _mm_loadu_si128((const __m128i *)b);
 
-    for (int j = n - 1; j >= 0; j--) {
-        (*buf)[(*i)++] = val >> (8 * j);
-    }
+    __m128i lo = _mm_unpacklo_epi8(v, z);
+    __m128i hi = _mm_unpackhi_epi8(v, z);
 
-    return 0;
+    _mm_storeu_si128((__m128i *)id + 0, _mm_unpacklo_epi16(lo, z));
+    _mm_storeu_si128((__m128i *)id + 1, _mm_unpackhi_epi16(lo, z));
+    _mm_storeu_si128((__m128i *)id + 2, _mm_unpacklo_epi16(hi, z));
+    _mm_storeu_si128((__m128i *)id + 3, _mm_unpackhi_epi16(hi, z));
 }
 
-int asn1_enc_long(char **buf, int *i, int *l, int tp, long long val) {
-    int n = 1;
-    for (unsigned long long q = val >> 8; q != 0; q >>= 8) {
-        n++;
-    }
+// arc of l <= 5 bytes, 7 bits of each
+static uint32_t _compress(const unsigned char *c, int l) {
+    uint64_t x;
+    memcpy(&x, c, sizeof(x));
 
-    int r = _grow(buf, i, l, 2 + n);
-    if (r) {
-        return -1;
-    }
+    x = __builtin_bswap64(x) >> (64 - 8 * l);
+    x &= 0x7f7f7f7f7f7f7f7fULL;
 
-    (*buf)[(*i)++] = tp;
-    (*buf)[(*i)++] = n;
+    x = (x & 0x7f) | (x >> 1 & 0x3f80) | (x >> 2 & 0x1fc000) | (x >> 3 & 0xfe00000) | (x >> 4 & 0x7f0000000ULL);
 
-    for (int j = n - 1; j >= 0; j--) {
-        (*buf)[(*i)++] = val >> (8 * j);
-    }
+    return (uint32_t)x;
+}
 
-    return 0;
+// 8 one byte arcs
+static void _widen8(const char *b, uint32_t *id) {
+    __m128i z = _mm_setzero_si128();
+    __m128i v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)b), z);
+
+    _mm_storeu_si128((__m128i *)id + 0, _mm_unpacklo_epi16(v, z));
+    _mm_storeu_si128((__m128i *)id + 1, _mm_unpackhi_epi16(v, z));
 }
 
-int asn1_enc_string(char **buf, int *i, int *l, int tp, asn1_str_t val) {
-    int r = _grow(buf, i, l, 1 + _len_size(val.len) + val.len);
-    if (r) {
-        return -1;
-    }
+// _dec_sub_simd finds arc boundaries in 32 byte blocks by continuation bits.
+// Runs of one byte arcs are widened up to 8 or 32 at a time, longer arcs
+// are assembled from their bytes at once.
+static int _dec_sub_simd(const char *b, int n, uint32_t *id, int cap) {
+    int len = 0;
+    int j = 0;
 
-    (*buf)[(*i)++] = tp;
-    _enc_len(*buf, i, val.len);
-    memcpy(*buf + *i, val.b, val.len);
+    while (j < n) {
+        int k = n - j < 32 ? n - j : 32;
 
-    *i += val.len;
+        // blocks are read with 8 bytes of slack, the tail is copied
+        const unsigned char *c = (const unsigned char *)b + j;
 
-    return 0;
-}
+        unsigned char tail[32 + 8];
+        if (n - j < 32 + 8) {
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, b + j, k);
 
-int asn1_enc_oid(char **buf, int *i, int *l, int tp, asn1_oid_t val) {
-    int len = 1;
-    for (int j = 2; j < val.len; j++) {
-        int q = val.b[j];
-
-        if (q < 0x80) {
-            len++;
-        } else if (q < 0x4000) {
-            len += 2;
-        } else if (q < 0x200000) {
-            len += 3;
-        } else if (q < 0x10000000) {
-            len += 4;
-        } else {
-            len += 5;
+            c = tail;
         }
-    }
 
-    int r = _grow(buf, i, l, 1 + _len_size(len) + len);
-    if (r) {
-        return -1;
-    }
+        const char *cb = (const char *)c;
 
-    (*buf)[(*i)++] = tp;
-    _enc_len(*buf, i, len);
+        unsigned m = _cont_mask(cb);
+        unsigned valid = k == 32 ? ~0U : (1U << k) - 1;
 
-    if (val.len == 0) {
-        (*buf)[(*i)++] = 0;
-    } else if (val.b[0] > 2) {
-        return -1;
-    } else if (val.len == 1) {
-        (*buf)[(*i)++] = val.b[0] * 40;
-    } else if (val.b[1] >= 40) {
-        return -1;
-    } else {
-        (*buf)[(*i)++] = val.b[0] * 40 + val.b[1];
-    }
-
-    for (int j = 2; j < val.len; j++) {
-        int q = val.b[j];
-
-        if (q < 0x80) {
-            (*buf)[(*i)++] = q;
-        } else if (q < 0x4000) {
-            (*buf)[(*i)++] = (q >> 7) | 0x80;
-            (*buf)[(*i)++] = q & 0x7f;
-        } else if (q < 0x200000) {
-            (*buf)[(*i)++] = (q >> 14) | 0x80;
-            (*buf)[(*i)++] = (q >> 7) | 0x80;
-            (*buf)[(*i)++] = q & 0x7f;
-        } else if (q < 0x10000000) {
-            (*buf)[(*i)++] = (q >> 21) | 0x80;
-            (*buf)[(*i)++] = (q >> 14) | 0x80;
-            (*buf)[(*i)++] = (q >> 7) | 0x80;
-            (*buf)[(*i)++] = q & 0x7f;
-        } else {
-            (*buf)[(*i)++] = (q >> 28) | 0x80;
-            (*buf)[(*i)++] = (q >> 21) | 0x80;
-            (*buf)[(*i)++] = (q >> 14) | 0x80;
-            (*buf)[(*i)++] = (q >> 7) | 0x80;
-            (*buf)[(*i)++] = q & 0x7f;
+        if (m == 0 && k == 32 && cap - len >= 32) {
+            _widen16(cb, id + len);
+            _widen16(cb + 16, id + len + 16);
+
+            len += 32;
+            j += 32;
+
+            continue;
         }
-    }
 
-    return 0;
-}
+        int s = 0;
+        int stop = 0;
 
-int asn1_enc_sequence(char **buf, int *i, int *l, int tp, int (*c)(char **buf, int *i, int *l, void *arg), void *arg) {
-    int st = *i;
+        while (s < k) {
+            // one byte arcs: widen 8 bytes, take as many as there are
+            unsigned rest = m >> s;
+            int r = rest ? __builtin_ctz(rest) : k - s;
 
-    int r = c(buf, i, l, arg);
-    if (r) {
-        return -1;
-    }
+            if (r > 0) {
+                if (cap - len < 8) {
+                    stop = 1;
+                    break;
+                }
 
-    int len = *i - st;
-    int ll = _len_size(len);
+                _widen8(cb + s, id + len);
 
-    r = _grow(buf, &st, l, 1 + ll + len);
-    if (r) {
-        return -1;
-    }
+                r = r < 8 ? r : 8;
+                len += r;
+                s += r;
 
-    memmove(*buf + st + 1 + ll, *buf + st, len);
+                continue;
+            }
 
-    (*buf)[st++] = tp;
-    _enc_len(*buf, &st, len);
+            unsigned ends = (~m & valid) >> s;
+            if (ends == 0) {
+                break;
+            }
 
-    *i += 1 + ll;
+            int l = __builtin_ctz(ends) + 1;
 
-    return 0;
-}
+            if (l > 5 || len == cap) {
+                stop = 1;
+                break;
+            }
+
+            id[len++] = _compress(c + s, l);
+
+            s += l;
+        }
+
+        j += s;
+
+        if (stop || s < k) {
+            break;
+        }
+    }
+
+    int r = _dec_sub_scalar(b + j, n - j, id + len, cap - len);
+    if (r < 0) {
+        return -1;
+    }
+
+    return len + r;
+}
+
+static int _sub_len_simd(const uint32_t *a, int n) {
+    // arcs are unsigned, compares are signed: flip the sign bits of both
+    __m128i sb = _mm_set1_epi32((int)0x80000000);
+
+    __m128i t1 = _mm_xor_si128(_mm_set1_epi32(0x7f), sb);
+    __m128i t2 = _mm_xor_si128(_mm_set1_epi32(0x3fff), sb);
+    __m128i t3 = _mm_xor_si128(_mm_set1_epi32(0x1fffff), sb);
+    __m128i t4 = _mm_xor_si128(_mm_set1_epi32(0xfffffff), sb);
+
+    __m128i acc = _mm_setzero_si128();
+
+    int j = 0;
+    for (; j + 4 <= n; j += 4) {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + j)), sb);
+
+        // compare results are -1 for each extra byte
+        acc = _mm_sub_epi32(acc, _mm_cmpgt_epi32(v, t1));
+        acc = _mm_sub_epi32(acc, _mm_cmpgt_epi32(v, t2));
+        acc = _mm_sub_epi32(acc, _mm_cmpgt_epi32(v, t3));
+        acc = _mm_sub_epi32(acc, _mm_cmpgt_epi32(v, t4));
+    }
+
+    int lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+
+    return j + lanes[0] + lanes[1] + lanes[2] + lanes[3] + _sub_len_scalar(a + j, n - j);
+}
+
+// 8 arcs as bytes if all of them are one byte ones
+static int _pack8(const uint32_t *a, __m128i *p) {
+    __m128i t = _mm_set1_epi32(~0x7f);
+
+    __m128i lo = _mm_loadu_si128((const __m128i *)a);
+    __m128i hi = _mm_loadu_si128((const __m128i *)(a + 4));
+
+    __m128i big = _mm_and_si128(_mm_or_si128(lo, hi), t);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(big, _mm_setzero_si128())) != 0xffff) {
+        return 0;
+    }
+
+    __m128i w = _mm_packs_epi32(lo, hi);
+
+    *p = _mm_packus_epi16(w, w);
+
+    return 1;
+}
+
+static int _enc_sub_simd(char *b, const uint32_t *a, int n) {
+    int k = 0;
+
+    for (int j = 0; j < n;) {
+        __m128i p;
+
+        if (n - j >= 8 && _pack8(a + j, &p)) {
+            _mm_storel_epi64((__m128i *)(b + k), p);
+
+            k += 8;
+            j += 8;
+
+            continue;
+        }
+
+        k += _enc_sub1(b + k, a[j]);
+        j++;
+    }
+
+    return k;
+}
+
+static int _renc_sub_simd(char *b, const uint32_t *a, int n) {
+    int k = 0;
+
+    for (int j = n; j > 0;) {
+        __m128i p;
+
+        if (j >= 8 && _pack8(a + j - 8, &p)) {
+            k += 8;
+            j -= 8;
+
+            _mm_storel_epi64((__m128i *)(b - k), p);
+
+            continue;
+        }
+
+        j--;
+
+        k += _sub_len1(a[j]);
+        _enc_sub1(b - k, a[j]);
+    }
+
+    return k;
+}
+
+#endif
+
+static int _dec_sub(const char *b, int n, uint32_t *id, int cap) {
+#ifdef ASN1_SIMD
+    // short ones are faster byte by byte
+    if (_simd && n >= 32) {
+        return _dec_sub_simd(b, n, id, cap);
+    }
+#endif
+
+    return _dec_sub_scalar(b, n, id, cap);
+}
+
+static int _sub_len(const uint32_t *a, int n) {
+#ifdef ASN1_SIMD
+    if (_simd) {
+        return _sub_len_simd(a, n);
+    }
+#endif
+
+    return _sub_len_scalar(a, n);
+}
+
+static int _enc_sub(char *b, const uint32_t *a, int n) {
+#ifdef ASN1_SIMD
+    if (_simd) {
+        return _enc_sub_simd(b, a, n);
+    }
+#endif
+
+    return _enc_sub_scalar(b, a, n);
+}
+
+static int _renc_sub(char *b, const uint32_t *a, int n) {
+#ifdef ASN1_SIMD
+    if (_simd) {
+        return _renc_sub_simd(b, a, n);
+    }
+#endif
+
+    return _renc_sub_scalar(b, a, n);
+}
+
+static int _dec_arcs(const char *b, int n, uint32_t *id, int cap) {
+    if (cap < 2) {
+        return -1;
+    }
+
+    id[0] = (unsigned char)b[0] / 40;
+    id[1] = (unsigned char)b[0] % 40;
+
+    int r = _dec_sub(b + 1, n - 1, id + 2, cap - 2);
+    if (r < 0) {
+        return -1;
+    }
+
+    return 2 + r;
+}
+
+// _dec_oid decodes n bytes of contents into id, arcs go inline if they fit
+static int _dec_oid(asn1_arena_t *a, const char *b, int n, asn1_oid_t *id) {
+    if (id->len > ASN1_OID_INLINE) {
+        asn1_release(a, id->ext);
+    }
+    id->ext = NULL;
+    id->len = 0;
+
+    if (n == 0) {
+        return 0;
+    }
+
+    int len = _dec_arcs(b, n, id->in, ASN1_OID_INLINE);
+    if (len < 0) {
+        // n bytes are at most n + 1 arcs
+        id->ext = asn1_alloc(a, (n + 1) * sizeof(uint32_t));
+        len = _dec_arcs(b, n, id->ext, n + 1);
+    }
+
+    id->len = len;
+
+    return 0;
+}
+
+int asn1_dec_oid(const char *b, int *i, int l, asn1_oid_t *id) {
+    return asn1_arena_dec_oid(NULL, b, i, l, id);
+}
+
+int asn1_arena_dec_oid(asn1_arena_t *a, const char *b, int *i, int l, asn1_oid_t *id) {
+    int n = asn1_dec_length(b, i, l);
+    if (n < 0) {
+        return -1;
+    }
+    if (*i + n > l) {
+        return -1;
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    _dec_oid(a, b + *i, n, id);
+
+    *i += n;
+
+    return 0;
+}
+
+int asn1_dec_ref(const char *b, int *i, int l, asn1_str_t *val) {
+    int n = asn1_dec_length(b, i, l);
+    if (n < 0) {
+        return -1;
+    }
+    if (*i + n > l) {
+        return -1;
+    }
+
+    val->b = (char *)b + *i;
+    val->len = n;
+
+    *i += n;
+
+    return 0;
+}
+
+int asn1_ref_int(asn1_str_t r, int *val) {
+    int res = 0;
+
+    for (int j = 0; j < r.len; j++) {
+        res = res << 8 | (unsigned char)r.b[j];
+    }
+
+    *val = res;
+
+    return 0;
+}
+
+int asn1_ref_long(asn1_str_t r, long long *val) {
+    long long res = 0;
+
+    for (int j = 0; j < r.len; j++) {
+        res = res << 8 | (unsigned char)r.b[j];
+    }
+
+    *val = res;
+
+    return 0;
+}
+
+int asn1_ref_arcs(asn1_str_t r, uint32_t *id, int cap) {
+    if (r.len == 0) {
+        return 0;
+    }
+
+    return _dec_arcs(r.b, r.len, id, cap);
+}
+
+int asn1_ref_oid(asn1_arena_t *a, asn1_str_t r, asn1_oid_t *id) {
+    return _dec_oid(a, r.b, r.len, id);
+}
+
+// key arcs take as many bytes as BER ones
+static int _key_arc(char *b, uint32_t q) {
+    static const unsigned char lead[] = {0, 0x00, 0x80, 0xc0, 0xe0, 0xf0};
+
+    int n = _sub_len1(q);
+
+    for (int j = n - 1; j > 0; j--) {
+        b[j] = q;
+        q >>= 8;
+    }
+
+    b[0] = lead[n] | (n == 5 ? 0 : q);
+
+    return n;
+}
+
+// asn1_oid_key writes the key of id to b, returns its length or -1 if
+// it doesn't fit. ASN1_OID_KEY_MAX(id->len) is always enough.
+int asn1_oid_key(const asn1_oid_t *id, char *b, int cap) {
+    const uint32_t *a = asn1_oid_arcs(id);
+    int k = 0;
+
+    for (int j = 0; j < id->len; j++) {
+        if (cap - k < _sub_len1(a[j])) {
+            return -1;
+        }
+
+        k += _key_arc(b + k, a[j]);
+    }
+
+    return k;
+}
+
+int asn1_key_oid(asn1_arena_t *a, asn1_str_t k, asn1_oid_t *id) {
+    if (id->len > ASN1_OID_INLINE) {
+        asn1_release(a, id->ext);
+    }
+    *id = (asn1_oid_t){0};
+
+    // every arc takes a byte at least
+    uint32_t *arcs = id->in;
+    if (k.len > ASN1_OID_INLINE) {
+        arcs = asn1_alloc(a, k.len * sizeof(uint32_t));
+    }
+
+    int len = 0;
+
+    for (int j = 0; j < k.len;) {
+        int q = (unsigned char)k.b[j];
+        int n = q < 0x80 ? 1 : q < 0xc0 ? 2 : q < 0xe0 ? 3 : q < 0xf0 ? 4 : 5;
+
+        if (j + n > k.len) {
+            if (arcs != id->in) {
+                asn1_release(a, arcs);
+            }
+            return -1;
+        }
+
+        uint32_t v = q & (0xff >> n);
+        for (int t = 1; t < n; t++) {
+            v = v << 8 | (unsigned char)k.b[j + t];
+        }
+
+        arcs[len++] = v;
+        j += n;
+    }
+
+    id->len = len;
+
+    if (arcs != id->in) {
+        if (len > ASN1_OID_INLINE) {
+            id->ext = arcs;
+        } else {
+            memcpy(id->in, arcs, len * sizeof(uint32_t));
+            asn1_release(a, arcs);
+        }
+    }
+
+    return 0;
+}
+
+int asn1_cmp_keys(asn1_str_t a, asn1_str_t b) {
+    int n = a.len < b.len ? a.len : b.len;
+
+    int r = n == 0 ? 0 : memcmp(a.b, b.b, n);
+    if (r != 0) {
+        return r < 0 ? -1 : 1;
+    }
+
+    return (a.len > b.len) - (a.len < b.len);
+}
+
+int asn1_key_has_prefix(asn1_str_t a, asn1_str_t b) {
+    return a.len >= b.len && (b.len == 0 || memcmp(a.b, b.b, b.len) == 0);
+}
+
+int asn1_dec_sequence(const char *b, int *i, int l, int (*c)(const char *b, int *i, int l, int tp, void *arg), void *arg) {
+    if (*i >= l) {
+        return -1;
+    }
+
+    int tp = (int)b[(*i)++] & 0xff;
+
+    int rl = asn1_dec_length(b, i, l);
+    if (rl < 0) {
+        return -1;
+    }
+
+    return c(b, i, *i + rl, tp, arg);
+}
+
+int _grow(char **buf, int *i, int *l, int s) {
+    if (*i + s <= *l) {
+        return 0;
+    }
+
+    while (*i + s > *l) {
+        if (*l == 0) {
+            *l = 20;
+        } else if (*l < 1000) {
+            *l *= 2;
+        } else {
+            *l += *l / 4;
+        }
+    }
+
+    *buf = asn1_realloc(NULL, *buf, 0, *l);
+    if (*buf == NULL) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int _len_size(int l) {
+    if (l < 0x80) {
+        return 1;
+    }
+
+    int s = 2;
+
+    for (unsigned q = l >> 8; q != 0; q >>= 8) {
+        s++;
+    }
+
+    return s;
+}
+
+static void _enc_len(char *buf, int *i, int len) {
+    if (len < 0x80) {
+        buf[(*i)++] = len;
+        return;
+    }
+
+    int n = 1;
+    for (unsigned q = len >> 8; q != 0; q >>= 8) {
+        n++;
+    }
+
+    buf[(*i)++] = n | ASN1_LONGLEN;
+
+    for (int j = n - 1; j >= 0; j--) {
+        buf[(*i)++] = len >> (8 * j);
+    }
+}
+
+int asn1_header_size(int len) {
+    return 1 + _len_size(len);
+}
+
+int asn1_int_size(int val) {
+    int n = 1;
+    for (unsigned q = val >> 8; q != 0; q >>= 8) {
+        n++;
+    }
+
+    return 2 + n;
+}
+
+int asn1_long_size(long long val) {
+    int n = 1;
+    for (unsigned long long q = val >> 8; q != 0; q >>= 8) {
+        n++;
+    }
+
+    return 2 + n;
+}
+
+// _uint_len is the number of content bytes of val, the 0x00 included
+static int _uint_len(unsigned long long val) {
+    int n = 1;
+    for (unsigned long long q = val >> 8; q != 0; q >>= 8) {
+        n++;
+    }
+
+    if (val >> (8 * n - 1) & 1) {
+        n++;
+    }
+
+    return n;
+}
+
+int asn1_uint_size(unsigned long long val) {
+    return 2 + _uint_len(val);
+}
+
+int asn1_oid_size(const asn1_oid_t *val) {
+    int len = 1;
+    if (val->len > 2) {
+        len += _sub_len(asn1_oid_arcs(val) + 2, val->len - 2);
+    }
+
+    return asn1_header_size(len) + len;
+}
+
+int asn1_enc_null(char **buf, int *i, int *l, int tp) {
+    int r = _grow(buf, i, l, 2);
+    if (r) {
+        return -1;
+    }
+
+    (*buf)[(*i)++] = tp;
+    (*buf)[(*i)++] = 0;
+
+    return 0;
+}
+
+int asn1_enc_int(char **buf, int *i, int *l, int tp, int val) {
+    int n = 1;
+    for (unsigned q = val >> 8; q != 0; q >>= 8) {
+        n++;
+    }
+
+    int r = _grow(buf, i, l, 2 + n);
+    if (r) {
+        return -1;
+    }
+
+    (*buf)[(*i)++] = tp;
+    (*buf)[(*i)++] = n;
+
+    for (int j = n - 1; j >= 0; j--) {
+        (*buf)[(*i)++] = val >> (8 * j);
+    }
+
+    return 0;
+}
+
+int asn1_enc_long(char **buf, int *i, int *l, int tp, long long val) {
+    int n = 1;
+    for (unsigned long long q = val >> 8; q != 0; q >>= 8) {
+        n++;
+    }
+
+    int r = _grow(buf, i, l, 2 + n);
+    if (r) {
+        return -1;
+    }
+
+    (*buf)[(*i)++] = tp;
+    (*buf)[(*i)++] = n;
+
+    for (int j = n - 1; j >= 0; j--) {
+        (*buf)[(*i)++] = val >> (8 * j);
+    }
+
+    return 0;
+}
+
+int asn1_enc_uint(char **buf, int *i, int *l, int tp, unsigned long long val) {
+    int n = _uint_len(val);
+
+    int r = _grow(buf, i, l, 2 + n);
+    if (r) {
+        return -1;
+    }
+
+    (*buf)[(*i)++] = tp;
+    (*buf)[(*i)++] = n;
+
+    for (int j = n - 1; j >= 0; j--) {
+        (*buf)[(*i)++] = j < 8 ? val >> (8 * j) : 0;
+    }
+
+    return 0;
+}
+
+int asn1_enc_string(char **buf, int *i, int *l, int tp, asn1_str_t val) {
+    int r = _grow(buf, i, l, 1 + _len_size(val.len) + val.len);
+    if (r) {
+        return -1;
+    }
+
+    (*buf)[(*i)++] = tp;
+    _enc_len(*buf, i, val.len);
+    memcpy(*buf + *i, val.b, val.len);
+
+    *i += val.len;
+
+    return 0;
+}
+
+// asn1_enc_raw copies already encoded data
+int asn1_enc_raw(char **buf, int *i, int *l, asn1_str_t val) {
+    int r = _grow(buf, i, l, val.len);
+    if (r) {
+        return -1;
+    }
+
+    memcpy(*buf + *i, val.b, val.len);
+
+    *i += val.len;
+
+    return 0;
+}
+
+int asn1_enc_oid(char **buf, int *i, int *l, int tp, const asn1_oid_t *val) {
+    const uint32_t *a = asn1_oid_arcs(val);
+
+    int len = 1;
+    if (val->len > 2) {
+        len += _sub_len(a + 2, val->len - 2);
+    }
+
+    int r = _grow(buf, i, l, 1 + _len_size(len) + len);
+    if (r) {
+        return -1;
+    }
+
+    (*buf)[(*i)++] = tp;
+    _enc_len(*buf, i, len);
+
+    if (val->len == 0) {
+        (*buf)[(*i)++] = 0;
+    } else if (a[0] > 2) {
+        return -1;
+    } else if (val->len == 1) {
+        (*buf)[(*i)++] = a[0] * 40;
+    } else if (a[1] >= 40) {
+        return -1;
+    } else {
+        (*buf)[(*i)++] = a[0] * 40 + a[1];
+    }
+
+    if (val->len > 2) {
+        *i += _enc_sub(*buf + *i, a + 2, val->len - 2);
+    }
+
+    return 0;
+}
+
+int asn1_enc_sequence(char **buf, int *i, int *l, int tp, int (*c)(char **buf, int *i, int *l, void *arg), void *arg) {
+    int st = *i;
+
+    int r = c(buf, i, l, arg);
+    if (r) {
+        return -1;
+    }
+
+    int len = *i - st;
+    int ll = _len_size(len);
+
+    r = _grow(buf, &st, l, 1 + ll + len);
+    if (r) {
+        return -1;
+    }
+
+    memmove(*buf + st + 1 + ll, *buf + st, len);
+
+    (*buf)[st++] = tp;
+    _enc_len(*buf, &st, len);
+
+    *i += 1 + ll;
+
+    return 0;
+}
+
+void asn1_rbuf_init(asn1_rbuf_t *w, char *b, int cap) {
+    *w = (asn1_rbuf_t){
+        .b = b,
+        .i = cap,
+        .cap = cap,
+    };
+}
+
+void asn1_rbuf_segs(asn1_rbuf_t *w, asn1_rbuf_seg_t *segs, int cap, int min) {
+    w->segs = segs;
+    w->segs_cap = cap;
+    w->seg_min = min;
+}
+
+// asn1_rbuf_pieces lists the message parts in order, returns their number
+// or -1 if cap is not enough. 2 * segs_len + 1 always is.
+int asn1_rbuf_pieces(const asn1_rbuf_t *w, asn1_str_t *p, int cap) {
+    int n = 0;
+    int at = w->i + w->ext;
+
+    for (int j = w->segs_len - 1; j >= -1; j--) {
+        int end = j >= 0 ? w->segs[j].at : w->cap;
+
+        if (end > at) {
+            if (n == cap) {
+                return -1;
+            }
+
+            p[n++] = (asn1_str_t){w->b + at, end - at};
+        }
+
+        if (j >= 0) {
+            if (n == cap) {
+                return -1;
+            }
+
+            p[n++] = (asn1_str_t){(char *)w->segs[j].b, w->segs[j].len};
+        }
+
+        at = end;
+    }
+
+    return n;
+}
+
+// _ref adds val as a segment if it's worth it and there is place for it
+static int _ref(asn1_rbuf_t *w, asn1_str_t val) {
+    if (val.len == 0 || val.len < w->seg_min || w->segs_len == w->segs_cap) {
+        return 0;
+    }
+
+    w->segs[w->segs_len++] = (asn1_rbuf_seg_t){
+        .b = val.b,
+        .len = val.len,
+        .at = w->i + w->ext,
+    };
+
+    w->i -= val.len;
+    w->ext += val.len;
+
+    return 1;
+}
+
+static int _room(asn1_rbuf_t *w, int n) {
+    if (w->i + w->ext >= n) {
+        return 0;
+    }
+
+    w->full = 1;
+
+    return -1;
+}
+
+static void _renc_len(asn1_rbuf_t *w, int len) {
+    if (len < 0x80) {
+        w->b[--w->i + w->ext] = len;
+        return;
+    }
+
+    int n = 0;
+    for (unsigned q = len; q != 0; q >>= 8) {
+        w->b[--w->i + w->ext] = q;
+        n++;
+    }
+
+    w->b[--w->i + w->ext] = n | ASN1_LONGLEN;
+}
+
+static int _renc_header(asn1_rbuf_t *w, int tp, int len) {
+    if (_room(w, 1 + _len_size(len))) {
+        return -1;
+    }
+
+    _renc_len(w, len);
+    w->b[--w->i + w->ext] = tp;
+
+    return 0;
+}
+
+int asn1_renc_sequence(asn1_rbuf_t *w, int tp, int end) {
+    return _renc_header(w, tp, end - w->i);
+}
+
+int asn1_renc_null(asn1_rbuf_t *w, int tp) {
+    return _renc_header(w, tp, 0);
+}
+
+int asn1_renc_int(asn1_rbuf_t *w, int tp, int val) {
+    if (_room(w, 2 + sizeof(val))) {
+        return -1;
+    }
+
+    int n = 1;
+    w->b[--w->i + w->ext] = val;
+
+    for (unsigned q = val >> 8; q != 0; q >>= 8) {
+        w->b[--w->i + w->ext] = val >> (8 * n++);
+    }
+
+    w->b[--w->i + w->ext] = n;
+    w->b[--w->i + w->ext] = tp;
+
+    return 0;
+}
+
+int asn1_renc_long(asn1_rbuf_t *w, int tp, long long val) {
+    if (_room(w, 2 + sizeof(val))) {
+        return -1;
+    }
+
+    int n = 1;
+    w->b[--w->i + w->ext] = val;
+
+    for (unsigned long long q = val >> 8; q != 0; q >>= 8) {
+        w->b[--w->i + w->ext] = val >> (8 * n++);
+    }
+
+    w->b[--w->i + w->ext] = n;
+    w->b[--w->i + w->ext] = tp;
+
+    return 0;
+}
+
+int asn1_renc_uint(asn1_rbuf_t *w, int tp, unsigned long long val) {
+    int n = _uint_len(val);
+
+    if (_room(w, 2 + n)) {
+        return -1;
+    }
+
+    for (int j = 0; j < n; j++) {
+        w->b[--w->i + w->ext] = j < 8 ? val >> (8 * j) : 0;
+    }
+
+    w->b[--w->i + w->ext] = n;
+    w->b[--w->i + w->ext] = tp;
+
+    return 0;
+}
+
+int asn1_renc_string(asn1_rbuf_t *w, int tp, asn1_str_t val) {
+    int r = asn1_renc_raw(w, val);
+    if (r) {
+        return -1;
+    }
+
+    return _renc_header(w, tp, val.len);
+}
+
+int asn1_renc_raw(asn1_rbuf_t *w, asn1_str_t val) {
+    if (_ref(w, val)) {
+        return 0;
+    }
+
+    if (_room(w, val.len)) {
+        return -1;
+    }
+
+    w->i -= val.len;
+    memcpy(w->b + w->i + w->ext, val.b, val.len);
+
+    return 0;
+}
+
+int asn1_renc_oid(asn1_rbuf_t *w, int tp, const asn1_oid_t *val) {
+    const uint32_t *a = asn1_oid_arcs(val);
+
+    int len = 1;
+    if (val->len > 2) {
+        len += _sub_len(a + 2, val->len - 2);
+    }
+
+    if (_room(w, len)) {
+        return -1;
+    }
+
+    int end = w->i;
+
+    if (val->len > 2) {
+        w->i -= _renc_sub(w->b + w->i + w->ext, a + 2, val->len - 2);
+    }
+
+    if (val->len == 0) {
+        w->b[--w->i + w->ext] = 0;
+    } else if (a[0] > 2) {
+        return -1;
+    } else if (val->len == 1) {
+        w->b[--w->i + w->ext] = a[0] * 40;
+    } else if (a[1] >= 40) {
+        return -1;
+    } else {
+        w->b[--w->i + w->ext] = a[0] * 40 + a[1];
+    }
+
+    return _renc_header(w, tp, end - w->i);
+}
+
+void asn1_dump_oid(const asn1_oid_t *d) {
+    const uint32_t *a = asn1_oid_arcs(d);
 
-void asn1_dump_oid(asn1_oid_t d) {
-    for (int j = 0; j < d.len; j++) {
+    for (int j = 0; j < d->len; j++) {
         if (j != 0) {
             fprintf(stderr, ".");
         }
-        fprintf(stderr, "%d", d.b[j]);
+        fprintf(stderr, "%u", a[j]);
     }
 }
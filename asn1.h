@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdint.h>
+
 // types
 #define ASN1_BOOL    0x1
 #define ASN1_INT     0x2
@@ -25,44 +27,174 @@ typedef struct {
     int len;
 } asn1_str_t;
 
+#define ASN1_OID_INLINE 20
+
+// asn1_oid_t keeps up to ASN1_OID_INLINE arcs inline, longer ones are in
+// ext on the heap (or arena). Access arcs with asn1_oid_arcs.
 typedef struct {
-    int *b;
     int len;
+    uint32_t *ext;
+    uint32_t in[ASN1_OID_INLINE];
 } asn1_oid_t;
 
+static inline uint32_t *asn1_oid_arcs(const asn1_oid_t *o) {
+    return o->len > ASN1_OID_INLINE ? o->ext : (uint32_t *)o->in;
+}
+
 typedef struct {
     int code;
     int pos;
     const char *message;
 } asn1_error_t;
 
-int asn1_cmp_oids(asn1_oid_t a, asn1_oid_t b);
-int asn1_oid_has_prefix(asn1_oid_t a, asn1_oid_t b);
+// piece of data referenced by asn1_rbuf_t instead of copied,
+// it goes right before b[at] of the buffer
+typedef struct {
+    const char *b;
+    int len;
+    int at;
+} asn1_rbuf_seg_t;
+
+// back to front encoder buffer. Data is written from the end of b towards
+// its start, encoded message is b[i:cap] unless segs are used.
+// With segs (asn1_rbuf_segs) strings and raw data of seg_min bytes or more
+// are referenced and must outlive the buffer use. i counts them in, so
+// message length is still cap - i, but b[i + ext:cap] is what is in b.
+// asn1_rbuf_pieces puts it all together.
+typedef struct {
+    char *b;
+    int i;
+    int cap;
+    int full;  // encoding failed for lack of space
+
+    asn1_rbuf_seg_t *segs;
+    int segs_len;
+    int segs_cap;
+    int seg_min;
+    int ext;  // bytes in segs
+} asn1_rbuf_t;
+
+typedef struct asn1_arena_chunk asn1_arena_chunk_t;
+
+// bump allocator. Everything allocated from it is released at once by
+// asn1_arena_reset. Allocations that don't fit go to spill chunks and the
+// block is grown to fit them on the next reset.
+typedef struct {
+    char *b;
+    int len;
+    int cap;
+
+    asn1_arena_chunk_t *spill;
+    int spilled;
+} asn1_arena_t;
+
+typedef struct {
+    long long mallocs;  // malloc and realloc calls
+    long long frees;
+    long long arena_allocs;
+    long long arena_resets;
+} asn1_alloc_stats_t;
+
+// SIMD OID codec is used if compiled in (SSE2 or AVX2), on by default.
+// asn1_set_simd is for tests comparing it with the scalar one: the switch
+// is process wide and not thread-safe, set it before any other threads
+// encode or decode.
+void asn1_set_simd(int on);
+
+int asn1_cmp_oids(const asn1_oid_t *a, const asn1_oid_t *b);
+int asn1_oid_has_prefix(const asn1_oid_t *a, const asn1_oid_t *b);
+
+// OID keys are byte strings ordered by memcmp the same way OIDs are.
+// Each arc is a prefix-free big endian number: 0xxxxxxx, 10xxxxxx +1 byte,
+// 110xxxxx +2, 1110xxxx +3, 11110000 +4 bytes. A prefix OID has a prefix key.
+#define ASN1_OID_KEY_MAX(len) (5 * (len))
+
+int asn1_oid_key(const asn1_oid_t *id, char *b, int cap);
+int asn1_key_oid(asn1_arena_t *a, asn1_str_t k, asn1_oid_t *id);
+int asn1_cmp_keys(asn1_str_t a, asn1_str_t b);
+int asn1_key_has_prefix(asn1_str_t a, asn1_str_t b);
 
 void asn1_set_error(asn1_error_t *s, int p, const char *m);
 
+// per thread counters of the allocations made by asn1 and snmp
+asn1_alloc_stats_t *asn1_alloc_stats(void);
+
+// a == NULL means heap
+void *asn1_alloc(asn1_arena_t *a, int n);
+void *asn1_realloc(asn1_arena_t *a, void *p, int old, int n);
+void asn1_release(asn1_arena_t *a, void *p);
+
+int asn1_arena_init(asn1_arena_t *a, int cap);
+void asn1_arena_reset(asn1_arena_t *a);
+void asn1_arena_free(asn1_arena_t *a);
+
 void asn1_free_oid(asn1_oid_t *id);
 void asn1_free_str(asn1_str_t *s);
 
-asn1_oid_t asn1_crt_oid(const int *id, int l);
-asn1_oid_t *asn1_new_oid(const int *id, int l);
+asn1_oid_t asn1_crt_oid(const uint32_t *id, int l);
+asn1_oid_t *asn1_new_oid(const uint32_t *id, int l);
 asn1_str_t *asn1_new_str(const char *msg, int l);
 
+asn1_oid_t asn1_arena_crt_oid(asn1_arena_t *a, const uint32_t *id, int l);
+asn1_oid_t *asn1_arena_new_oid(asn1_arena_t *a, const uint32_t *id, int l);
+asn1_str_t *asn1_arena_new_str(asn1_arena_t *a, const char *msg, int l);
+
 int asn1_dec_length(const char *b, int *i, int l);
 
 int asn1_dec_int(const char *b, int *i, int l, int *val);
 int asn1_dec_long(const char *b, int *i, int l, long long *val);
+int asn1_dec_uint(const char *b, int *i, int l, unsigned long long *val);
 int asn1_dec_oid(const char *b, int *i, int l, asn1_oid_t *val);
 int asn1_dec_string(const char *b, int *i, int l, asn1_str_t *val);
 
+int asn1_arena_dec_oid(asn1_arena_t *a, const char *b, int *i, int l, asn1_oid_t *val);
+int asn1_arena_dec_string(asn1_arena_t *a, const char *b, int *i, int l, asn1_str_t *val);
+
+// views: val points into b, no copy and no trailing NUL, valid while b is
+int asn1_dec_ref(const char *b, int *i, int l, asn1_str_t *val);
+
+int asn1_ref_int(asn1_str_t r, int *val);
+int asn1_ref_long(asn1_str_t r, long long *val);
+int asn1_ref_oid(asn1_arena_t *a, asn1_str_t r, asn1_oid_t *id);
+int asn1_ref_arcs(asn1_str_t r, uint32_t *id, int cap);
+
 int asn1_dec_sequence(const char *b, int *i, int l, int (*c)(const char *b, int *i, int l, int tp, void *arg), void *arg);
 
 int asn1_enc_null(char **b, int *i, int *l, int tp);
 int asn1_enc_int(char **b, int *i, int *l, int tp, int val);
 int asn1_enc_long(char **b, int *i, int *l, int tp, long long val);
-int asn1_enc_oid(char **b, int *i, int *l, int tp, asn1_oid_t val);
+int asn1_enc_oid(char **b, int *i, int *l, int tp, const asn1_oid_t *val);
 int asn1_enc_string(char **b, int *i, int *l, int tp, asn1_str_t val);
+int asn1_enc_raw(char **b, int *i, int *l, asn1_str_t val);
+
+// uint is for the unsigned types (Counter32, Gauge32, TimeTicks,
+// Counter64): a 0x00 goes first if the top bit is set, so the value isn't
+// read as negative
+int asn1_enc_uint(char **b, int *i, int *l, int tp, unsigned long long val);
 
 int asn1_enc_sequence(char **b, int *i, int *l, int tp, int (*c)(char **b, int *i, int *l, void *arg), void *arg);
 
-void asn1_dump_oid(asn1_oid_t d);
+// asn1_*_size return the size the encoders write, tag and length included
+int asn1_header_size(int len);
+int asn1_int_size(int val);
+int asn1_long_size(long long val);
+int asn1_uint_size(unsigned long long val);
+int asn1_oid_size(const asn1_oid_t *val);
+
+void asn1_rbuf_init(asn1_rbuf_t *w, char *b, int cap);
+void asn1_rbuf_segs(asn1_rbuf_t *w, asn1_rbuf_seg_t *segs, int cap, int min);
+int asn1_rbuf_pieces(const asn1_rbuf_t *w, asn1_str_t *p, int cap);
+
+// children are encoded first (in reverse order), then the header for
+// everything written since end
+int asn1_renc_sequence(asn1_rbuf_t *w, int tp, int end);
+
+int asn1_renc_null(asn1_rbuf_t *w, int tp);
+int asn1_renc_int(asn1_rbuf_t *w, int tp, int val);
+int asn1_renc_long(asn1_rbuf_t *w, int tp, long long val);
+int asn1_renc_uint(asn1_rbuf_t *w, int tp, unsigned long long val);
+int asn1_renc_oid(asn1_rbuf_t *w, int tp, const asn1_oid_t *val);
+int asn1_renc_string(asn1_rbuf_t *w, int tp, asn1_str_t val);
+int asn1_renc_raw(asn1_rbuf_t *w, asn1_str_t val);
+
+void asn1_dump_oid(const asn1_oid_t *d);
@@ -0,0 +1,1406 @@
+// bench measures codec throughput over a corpus of typical packets.
+//
+//   ./bench                  run all
+//   ./bench -f bulk          run the groups with bulk in the name
+//   ./bench -f mib/flat      run the rows of a group with mib/flat in the name
+//   ./bench -b bench.baseline   compare with a baseline, exit 1 on regression
+//   ./bench -w bench.baseline   write a new baseline, with -f only the rows run
+//   ./bench -c               only check the codecs, exit 1 if they fail
+//
+// Rows slower than the baseline by -r percent (default 50) are marked, but
+// the timings are of the machine that wrote it and vary a lot on a busy
+// one, so they don't fail the run. Any allocations/packet growth is a
+// regression, as is any failed check. Allocations are asn1 mallocs and C++
+// operator new calls. Serving the example MIB must not allocate at all.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "easysnmp.hpp"
+#include "example_mib.hpp"
+
+using namespace snmp;
+
+static long long news = 0;  // operator new calls
+
+// not inlined, or gcc takes the free below for a mismatched delete
+__attribute__((noinline)) void *operator new(size_t n) {
+    news++;
+
+    void *p = malloc(n);
+    if (p == NULL) {
+        throw bad_alloc();
+    }
+
+    return p;
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept {
+    free(p);
+}
+
+struct Packet {
+    string name;
+    string data;
+};
+
+struct Result {
+    double ns;       // per packet
+    double allocs;   // per packet
+    double mbs;      // MB/s of packet bytes
+};
+
+static double seconds = 0.5;  // per bench
+static int rounds = 5;
+static double tolerance = 50;  // percent
+static const char *filter = "";  // of the rows to run
+
+// want tells if the row (or group) name is selected by the filter
+static bool want(const string &name) {
+    return strstr(name.c_str(), filter) != NULL;
+}
+
+// runs tells if the group has rows to run: its name has the filter in it,
+// or the filter names rows of it, as in "mib/flat"
+static bool runs(const string &group) {
+    return want(group) || strncmp(filter, (group + "/").c_str(), group.size() + 1) == 0;
+}
+
+static long long allocs() {
+    return asn1_alloc_stats()->mallocs + news;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static vector<uint32_t> oid(int n, uint32_t last) {
+    vector<uint32_t> v = {1, 3, 6, 1, 2, 1, 2, 2, 1};
+
+    while ((int)v.size() < n - 1) {
+        v.push_back(v.size() * 37 % 200);
+    }
+
+    v.push_back(last);
+
+    return v;
+}
+
+static asn1_str_t community() {
+    asn1_str_t *c = asn1_new_str("public", 0);
+    asn1_str_t s = *c;
+
+    asn1_release(NULL, c);
+
+    return s;
+}
+
+static void add(snmp_pdu_t *p, const vector<uint32_t> &id, int tp, const snmp_value_t *val) {
+    snmp_add_var(p, asn1_crt_oid(id.data(), id.size()), tp, val);
+}
+
+// row adds a varbind of the type picked by j
+static void row(snmp_pdu_t *p, int j, int oid_len) {
+    vector<uint32_t> id = oid(oid_len, j + 1);
+    snmp_value_t v = {};
+
+    switch (j % 5) {
+    case 0:
+        v.i = j * 1000;
+        add(p, id, SNMP_TP_INT, &v);
+        break;
+    case 1:
+        v.i = j * 7919;
+        add(p, id, SNMP_TP_COUNTER, &v);
+        break;
+    case 2:
+        v.l = j * 1000000007LL;
+        add(p, id, SNMP_TP_COUNTER64, &v);
+        break;
+    case 3:
+        snmp_arena_set_str(NULL, &v, "GigabitEthernet0/1", 18);
+        add(p, id, SNMP_TP_OCT_STR, &v);
+        break;
+    case 4:
+        snmp_arena_set_oid(NULL, &v, id.data(), id.size());
+        add(p, id, SNMP_TP_OID, &v);
+        break;
+    }
+}
+
+static string encode(snmp_pdu_t *p) {
+    char *b = NULL;
+    int i = 0, l = 0;
+
+    int r = snmp_enc_pdu(&b, &i, &l, p);
+    if (r < 0) {
+        throw runtime_error("encode corpus");
+    }
+
+    string s(b, i);
+
+    free(b);
+
+    return s;
+}
+
+static Packet request(string name, int cmd, int n, int oid_len) {
+    snmp_pdu_t p = {};
+
+    p.version = SNMP_VERSION_2c;
+    p.community = community();
+    p.command = cmd;
+    p.req_id = 0x1234;
+    p.max_repetitions = cmd == SNMP_CMD_GET_BULK ? n : 0;
+
+    for (int j = 0; j < (cmd == SNMP_CMD_GET_BULK ? 1 : n); j++) {
+        add(&p, oid(oid_len, j + 1), SNMP_TP_NULL, NULL);
+    }
+
+    Packet pk{name, encode(&p)};
+
+    snmp_free_pdu(&p);
+
+    return pk;
+}
+
+// query is a request for the given oids
+static Packet query(string name, int cmd, const vector<vector<uint32_t>> &ids, int reps, int non_repeaters = 0) {
+    snmp_pdu_t p = {};
+
+    p.version = SNMP_VERSION_2c;
+    p.community = community();
+    p.command = cmd;
+    p.req_id = 0x1234;
+    p.max_repetitions = reps;
+    p.max_repeaters = non_repeaters;
+
+    for (auto &id : ids) {
+        add(&p, id, SNMP_TP_NULL, NULL);
+    }
+
+    Packet pk{name, encode(&p)};
+
+    snmp_free_pdu(&p);
+
+    return pk;
+}
+
+static Packet response(string name, int n, int oid_len) {
+    snmp_pdu_t p = {};
+
+    p.version = SNMP_VERSION_2c;
+    p.community = community();
+    p.command = SNMP_CMD_RESPONSE;
+    p.req_id = 0x1234;
+
+    for (int j = 0; j < n; j++) {
+        row(&p, j, oid_len);
+    }
+
+    Packet pk{name, encode(&p)};
+
+    snmp_free_pdu(&p);
+
+    return pk;
+}
+
+static Packet bigval(string name, int n, int size) {
+    snmp_pdu_t p = {};
+
+    p.version = SNMP_VERSION_2c;
+    p.community = community();
+    p.command = SNMP_CMD_RESPONSE;
+    p.req_id = 0x1234;
+
+    string v(size, 'x');
+
+    for (int j = 0; j < n; j++) {
+        snmp_value_t val = {};
+        snmp_arena_set_str(NULL, &val, v.data(), v.size());
+
+        add(&p, oid(10, j + 1), SNMP_TP_OCT_STR, &val);
+    }
+
+    Packet pk{name, encode(&p)};
+
+    snmp_free_pdu(&p);
+
+    return pk;
+}
+
+static vector<Packet> corpus() {
+    return {
+        request("get1", SNMP_CMD_GET, 1, 10),
+        request("get60", SNMP_CMD_GET, 60, 10),
+        request("getbulk", SNMP_CMD_GET_BULK, 100, 10),
+        response("resp1", 1, 10),
+        response("resp60", 60, 10),
+        response("bulk10", 10, 12),
+        response("bulk100", 100, 12),
+        response("bulk1000", 1000, 12),
+        response("longoid", 20, 64),
+        bigval("bigval", 8, 1000),
+    };
+}
+
+// measure runs f for a few rounds of seconds/rounds each and returns per
+// call numbers of the fastest round, slower ones are mostly noise
+template <typename F>
+static Result measure(const Packet &pk, F f) {
+    f();  // warm up
+
+    Result r = {0, 0, 0};
+
+    for (int round = 0; round < rounds; round++) {
+        long long n = 0;
+        long long mallocs = allocs();
+        double st = now(), el = 0;
+
+        for (long long batch = 1;; batch *= 2) {
+            for (long long k = 0; k < batch; k++) {
+                f();
+            }
+
+            n += batch;
+            el = now() - st;
+
+            if (el >= seconds / rounds * 1e9) {
+                break;
+            }
+        }
+
+        if (round == 0 || el / n < r.ns) {
+            r.ns = el / n;
+        }
+
+        r.allocs = (double)(allocs() - mallocs) / n;
+    }
+
+    r.mbs = pk.data.size() / r.ns * 1e3;
+
+    return r;
+}
+
+// check decodes and encodes pk every way there is and expects the same bytes back
+static bool check(const Packet &pk) {
+    bool ok = true;
+
+    for (int simd = 0; simd < 2; simd++) {
+        asn1_set_simd(simd);
+
+        snmp_pdu_t p = {};
+
+        if (snmp_dec_pdu(pk.data.data(), pk.data.size(), &p) < 0) {
+            cerr << pk.name << ": decode: " << p.error.message << endl;
+            ok = false;
+        }
+
+        string fwd = encode(&p);
+
+        vector<char> b(pk.data.size() + 64);
+        asn1_rbuf_t w;
+        asn1_rbuf_init(&w, b.data(), b.size());
+
+        snmp_renc_pdu(&w, &p);
+        string rev(w.b + w.i, w.cap - w.i);
+
+        if (fwd != pk.data || rev != pk.data) {
+            cerr << pk.name << ": round trip differs (simd " << simd << ")" << endl;
+            ok = false;
+        }
+
+        snmp_free_pdu(&p);
+    }
+
+    asn1_set_simd(1);
+
+    return ok;
+}
+
+// metric is the value of a new metric of type tp set to x
+static snmp_value_t metric(int tp, uint64_t x) {
+    switch (tp) {
+    case SNMP_TP_COUNTER: {
+        Counter32 m;
+        m.add(x);
+        return m.val();
+    }
+    case SNMP_TP_GAUGE: {
+        Gauge32 m;
+        m.set(x);
+        return m.val();
+    }
+    case SNMP_TP_TIMETICKS: {
+        TimeTicks m;
+        m.set(x);
+        return m.val();
+    }
+    default: {
+        Counter64 m;
+        m.add(x);
+        return m.val();
+    }
+    }
+}
+
+// check_uint encodes the unsigned types at the edges of their ranges, as
+// the metrics give them, every way there is. It expects the contents with
+// a 0x00 first where the top bit is set, and the same value decoded back.
+static bool check_uint() {
+    struct Edge {
+        uint64_t x;
+        string contents;
+    };
+
+    const vector<Edge> edges32 = {
+        {0, string("\x00", 1)},
+        {127, "\x7f"},
+        {128, string("\x00\x80", 2)},
+        {255, string("\x00\xff", 2)},
+        {1ULL << 31, string("\x00\x80\x00\x00\x00", 5)},
+        {(1ULL << 32) - 1, string("\x00\xff\xff\xff\xff", 5)},
+    };
+
+    vector<Edge> edges64 = edges32;
+    edges64.push_back({1ULL << 63, string("\x00\x80\x00\x00\x00\x00\x00\x00\x00", 9)});
+    edges64.push_back({~0ULL, string("\x00\xff\xff\xff\xff\xff\xff\xff\xff", 9)});
+
+    bool ok = true;
+
+    for (int tp : {SNMP_TP_COUNTER, SNMP_TP_GAUGE, SNMP_TP_TIMETICKS, SNMP_TP_COUNTER64}) {
+        for (const Edge &e : tp == SNMP_TP_COUNTER64 ? edges64 : edges32) {
+            string want = string(1, (char)tp) + (char)e.contents.size() + e.contents;
+            snmp_value_t v = metric(tp, e.x);
+
+            char *b = NULL;
+            int i = 0, l = 0;
+
+            snmp_enc_value(&b, &i, &l, tp, &v);
+            string enc(b, i);
+            free(b);
+
+            snmp_pdu_t p = {};
+            p.version = SNMP_VERSION_2c;
+            p.community = community();
+            p.command = SNMP_CMD_RESPONSE;
+
+            add(&p, {1, 3, 6, 1, 4, 1, 9, 9}, tp, &v);
+
+            int size = snmp_var_size(&p.vars[0]);
+            int body = asn1_oid_size(&p.vars[0].oid) + (int)want.size();
+
+            string fwd = encode(&p);
+
+            vector<char> rb(fwd.size() + 64);
+            asn1_rbuf_t w;
+            asn1_rbuf_init(&w, rb.data(), rb.size());
+            snmp_renc_pdu(&w, &p);
+            string rev(w.b + w.i, w.cap - w.i);
+
+            snmp_pdu_t d = {};
+            int r = snmp_dec_pdu(fwd.data(), fwd.size(), &d);
+
+            uint64_t got = 0;
+            if (r >= 0 && d.vars_len == 1) {
+                got = tp == SNMP_TP_COUNTER64 || tp == SNMP_TP_TIMETICKS ? (uint64_t)d.vars[0].value.l : (uint32_t)d.vars[0].value.i;
+            }
+
+            if (enc != want || fwd.find(want) == string::npos || rev != fwd || size != asn1_header_size(body) + body || r < 0 ||
+                got != e.x) {
+                cerr << "uint: type " << hex << tp << " value " << e.x << dec << " differs" << endl;
+                ok = false;
+            }
+
+            snmp_free_pdu(&d);
+            snmp_free_pdu(&p);
+        }
+    }
+
+    return ok;
+}
+
+// random_arc is an arc of 2 to 5 bytes or one near 2^32 with the chance
+// of long in 10, a one byte one otherwise
+static uint32_t random_arc(mt19937 &rnd, int lng) {
+    if ((int)(rnd() % 10) >= lng) {
+        return rnd() % 0x80;
+    }
+
+    int l = rnd() % 5;
+    if (l == 4) {
+        return 0xffffffff - rnd() % 0x100;
+    }
+
+    // l + 2 bytes
+    uint64_t lo = 1ULL << 7 * (l + 1), hi = l == 3 ? 1ULL << 32 : lo << 7;
+
+    return lo + rnd() % (hi - lo);
+}
+
+// oid_contents encodes the arcs with the scalar codec and returns the
+// contents of the OID
+static string oid_contents(const vector<uint32_t> &arcs) {
+    asn1_oid_t o = asn1_crt_oid(arcs.data(), arcs.size());
+
+    char *b = NULL;
+    int i = 0, l = 0;
+
+    asn1_enc_oid(&b, &i, &l, SNMP_TP_OID, &o);
+
+    int k = 1;
+    int n = asn1_dec_length(b, &k, i);
+    string r(b + k, n);
+
+    free(b);
+    asn1_free_oid(&o);
+
+    return r;
+}
+
+// check_simd encodes and decodes random OIDs with and without SIMD and
+// expects the same results. OIDs go up to 100 arcs, their contents get
+// cut, over-long arcs and flipped continuation bits, and are decoded to
+// all caps up to their length, so that the blocks, their tails and the
+// fallbacks in the middle of them are all crossed. It is seeded, so a
+// failure repeats.
+static bool check_simd() {
+    mt19937 rnd(2);
+    bool ok = true;
+
+    for (int it = 0; it < 4000; it++) {
+        // some OIDs are runs of one byte arcs only
+        int lng = rnd() % 11;
+
+        vector<uint32_t> arcs = {(uint32_t)(rnd() % 3), (uint32_t)(rnd() % 40)};
+        for (int k = rnd() % 100; k > 0; k--) {
+            arcs.push_back(random_arc(rnd, lng));
+        }
+
+        asn1_oid_t o = asn1_crt_oid(arcs.data(), arcs.size());
+
+        string enc[2];
+        int size[2];
+
+        for (int simd = 0; simd < 2; simd++) {
+            asn1_set_simd(simd);
+
+            char *b = NULL;
+            int i = 0, l = 0;
+
+            asn1_enc_oid(&b, &i, &l, SNMP_TP_OID, &o);
+            enc[simd] = string(b, i);
+            free(b);
+
+            vector<char> rb(i + 64);
+            asn1_rbuf_t w;
+            asn1_rbuf_init(&w, rb.data(), rb.size());
+            asn1_renc_oid(&w, SNMP_TP_OID, &o);
+
+            size[simd] = asn1_oid_size(&o);
+
+            if (string(w.b + w.i, w.cap - w.i) != enc[simd]) {
+                cerr << "simd: oid " << it << ": reverse encoding differs (simd " << simd << ")" << endl;
+                ok = false;
+            }
+        }
+
+        asn1_free_oid(&o);
+
+        if (enc[0] != enc[1] || size[0] != size[1] || size[1] != (int)enc[1].size()) {
+            cerr << "simd: oid " << it << ": encoding differs" << endl;
+            ok = false;
+        }
+
+        string c = oid_contents(arcs);
+
+        switch (rnd() % 4) {
+        case 1:
+            // cut, the last arc likely unfinished
+            c.resize(c.size() - min<size_t>(c.size() - 1, 1 + rnd() % 3));
+            c.back() |= rnd() % 2 ? 0x80 : 0;
+            break;
+        case 2: {
+            // an arc of 6 to 10 bytes
+            string a(5 + rnd() % 5, 0);
+            for (char &x : a) {
+                x = 0x80 | rnd();
+            }
+
+            c.insert(1 + rnd() % c.size(), a + (char)(rnd() % 0x80));
+            break;
+        }
+        case 3:
+            for (int k = c.size() > 1 ? 1 + rnd() % 4 : 0; k > 0; k--) {
+                c[1 + rnd() % (c.size() - 1)] ^= 0x80;
+            }
+            break;
+        }
+
+        // exactly as long as the contents, reads past them are errors
+        vector<char> cb(c.begin(), c.end());
+        asn1_str_t r = {cb.data(), (int)cb.size()};
+        vector<uint32_t> got[2];
+
+        for (int simd = 0; simd < 2; simd++) {
+            asn1_set_simd(simd);
+
+            asn1_oid_t d = {};
+            asn1_ref_oid(NULL, r, &d);
+            got[simd].assign(asn1_oid_arcs(&d), asn1_oid_arcs(&d) + d.len);
+            asn1_free_oid(&d);
+        }
+
+        if (got[0] != got[1]) {
+            cerr << "simd: contents " << it << " (" << c.size() << " bytes): decoding differs" << endl;
+            ok = false;
+        }
+
+        // every cap for the shorter ones, a random one for the rest
+        int from = c.size() < 100 ? 0 : rnd() % (c.size() + 3);
+        int to = c.size() < 100 ? c.size() + 2 : from;
+
+        for (int cap = from; cap <= to; cap++) {
+            vector<uint32_t> capped[2];
+            int n[2];
+
+            for (int simd = 0; simd < 2; simd++) {
+                asn1_set_simd(simd);
+
+                // exactly cap long too
+                capped[simd].resize(cap);
+                n[simd] = asn1_ref_arcs(r, capped[simd].data(), cap);
+                capped[simd].resize(max(n[simd], 0));
+            }
+
+            if (n[0] != n[1] || capped[0] != capped[1]) {
+                cerr << "simd: contents " << it << " (" << c.size() << " bytes, cap " << cap << "): decoding differs" << endl;
+                ok = false;
+            }
+        }
+    }
+
+    asn1_set_simd(1);
+
+    return ok;
+}
+
+// random_length is a string length at the edges of the BER lengths, or
+// any up to 2000
+static int random_length(mt19937 &rnd) {
+    static const int edges[] = {1, 127, 128, 255, 256, 1000};
+
+    return rnd() % 2 ? edges[rnd() % 6] : 1 + rnd() % 2000;
+}
+
+// random_var adds a varbind of a random type and value to p
+static void random_var(mt19937 &rnd, snmp_pdu_t *p) {
+    static const int types[] = {SNMP_TP_INT, SNMP_TP_COUNTER, SNMP_TP_GAUGE, SNMP_TP_INT64, SNMP_TP_COUNTER64,
+                                SNMP_TP_TIMETICKS, SNMP_TP_OCT_STR, SNMP_TP_IP_ADDR, SNMP_TP_OID, SNMP_TP_NULL,
+                                SNMP_TP_NO_SUCH_OBJ, SNMP_TP_END_OF_MIB_VIEW};
+
+    int tp = types[rnd() % (sizeof(types) / sizeof(types[0]))];
+    int lng = rnd() % 11;
+
+    vector<uint32_t> id = {1, 3};
+    for (int k = rnd() % 40; k > 0; k--) {
+        id.push_back(random_arc(rnd, lng));
+    }
+
+    // values at the edges of the int lengths as often as any
+    uint64_t x = (uint64_t)rnd() << 32 | rnd();
+    x >>= rnd() % 64;
+
+    snmp_value_t v = {};
+
+    switch (tp) {
+    case SNMP_TP_INT:
+    case SNMP_TP_COUNTER:
+    case SNMP_TP_GAUGE:
+        v.i = (int)x;
+        break;
+    case SNMP_TP_INT64:
+    case SNMP_TP_COUNTER64:
+    case SNMP_TP_TIMETICKS:
+        v.l = rnd() % 2 ? -(long long)x : (long long)x;
+        break;
+    case SNMP_TP_OCT_STR:
+    case SNMP_TP_IP_ADDR: {
+        string b(random_length(rnd), 0);
+        for (char &c : b) {
+            c = rnd();
+        }
+
+        snmp_arena_set_str(NULL, &v, b.data(), b.size());
+        break;
+    }
+    case SNMP_TP_OID:
+        snmp_arena_set_oid(NULL, &v, id.data(), id.size());
+        break;
+    }
+
+    add(p, id, tp, tp == SNMP_TP_NULL || tp == SNMP_TP_NO_SUCH_OBJ || tp == SNMP_TP_END_OF_MIB_VIEW ? NULL : &v);
+}
+
+// check_renc encodes random PDUs back to front, with and without segs,
+// and expects the bytes snmp_enc_pdu writes. Seeded, so a failure repeats.
+static bool check_renc() {
+    static const int cmds[] = {SNMP_CMD_GET, SNMP_CMD_GET_NEXT, SNMP_CMD_RESPONSE, SNMP_CMD_GET_BULK};
+
+    mt19937 rnd(3);
+    bool ok = true;
+
+    for (int it = 0; it < 2000; it++) {
+        snmp_pdu_t p = {};
+
+        p.version = rnd() % 2 ? SNMP_VERSION_2c : SNMP_VERSION_1;
+        p.command = cmds[rnd() % 4];
+        p.req_id = (int)rnd() >> rnd() % 32;
+
+        if (p.command == SNMP_CMD_GET_BULK) {
+            p.max_repeaters = rnd() % 300;
+            p.max_repetitions = rnd() % 300;
+        } else {
+            p.error_status = rnd() % 6;
+            p.error_index = rnd() % 300;
+        }
+
+        string c(random_length(rnd) % 300 + 1, 'c');
+        asn1_str_t *cs = asn1_new_str(c.data(), c.size());
+        p.community = *cs;
+        asn1_release(NULL, cs);
+
+        for (int k = rnd() % 60; k > 0; k--) {
+            random_var(rnd, &p);
+        }
+
+        string fwd = encode(&p);
+
+        vector<char> b(fwd.size() + 64);
+        asn1_rbuf_t w;
+        asn1_rbuf_init(&w, b.data(), b.size());
+        snmp_renc_pdu(&w, &p);
+        string rev(w.b + w.i, w.cap - w.i);
+
+        // segs reference the longer values, the pieces put them together
+        vector<char> sb(fwd.size() + 64);
+        asn1_rbuf_seg_t segs[SNMP_SEND_SEGS];
+        asn1_rbuf_init(&w, sb.data(), sb.size());
+        asn1_rbuf_segs(&w, segs, SNMP_SEND_SEGS, SNMP_SEND_SEG_MIN);
+        snmp_renc_pdu(&w, &p);
+
+        asn1_str_t pieces[2 * SNMP_SEND_SEGS + 1];
+        int np = asn1_rbuf_pieces(&w, pieces, 2 * SNMP_SEND_SEGS + 1);
+
+        string seg;
+        for (int j = 0; j < np; j++) {
+            seg.append(pieces[j].b, pieces[j].len);
+        }
+
+        if (rev != fwd || seg != fwd || w.full) {
+            cerr << "renc: pdu " << it << " (" << p.vars_len << " varbinds, " << fwd.size() << " bytes) differs" << endl;
+            ok = false;
+        }
+
+        snmp_free_pdu(&p);
+    }
+
+    return ok;
+}
+
+static map<string, Result> bench(const Packet &pk) {
+    map<string, Result> res;
+
+    const char *b = pk.data.data();
+    int len = pk.data.size();
+
+    asn1_arena_t arena;
+    asn1_arena_init(&arena, 1 << 16);
+
+    vector<snmp_var_ref_t> refs(2048);
+
+    vector<char> out(len + 64);
+
+    snmp_pdu_t dec = {};
+    snmp_dec_pdu(b, len, &dec);
+
+    res["dec"] = measure(pk, [&] {
+        snmp_pdu_t p = {};
+        snmp_dec_pdu(b, len, &p);
+        snmp_free_pdu(&p);
+    });
+
+    res["dec_arena"] = measure(pk, [&] {
+        snmp_pdu_t p = {};
+        p.arena = &arena;
+        snmp_dec_pdu(b, len, &p);
+        snmp_free_pdu(&p);
+        asn1_arena_reset(&arena);
+    });
+
+    res["dec_ref"] = measure(pk, [&] {
+        snmp_pdu_t p = {};
+        snmp_dec_pdu_ref(b, len, &p, refs.data(), refs.size());
+        snmp_free_pdu(&p);
+    });
+
+    res["dec_iter"] = measure(pk, [&] {
+        snmp_pdu_t p = {};
+        snmp_pdu_iter_t it;
+        snmp_var_ref_t v;
+        snmp_pdu_iter_init(&it, b, len, &p);
+        while (snmp_pdu_iter_next(&it, &v) > 0) {
+        }
+        snmp_free_pdu(&p);
+    });
+
+    res["enc"] = measure(pk, [&] {
+        char *o = out.data();
+        int i = 0, l = out.size();
+        snmp_enc_pdu(&o, &i, &l, &dec);
+    });
+
+    res["renc"] = measure(pk, [&] {
+        asn1_rbuf_t w;
+        asn1_rbuf_init(&w, out.data(), out.size());
+        snmp_renc_pdu(&w, &dec);
+    });
+
+    vector<string> keys;
+    for (int j = 0; j < dec.vars_len; j++) {
+        const asn1_oid_t &id = dec.vars[j].oid;
+
+        string k(ASN1_OID_KEY_MAX(id.len), 0);
+        k.resize(asn1_oid_key(&id, &k[0], k.size()));
+
+        keys.push_back(k);
+    }
+
+    volatile int sink = 0;
+
+    res["oid_cmp"] = measure(pk, [&] {
+        for (int j = 1; j < dec.vars_len; j++) {
+            sink += asn1_cmp_oids(&dec.vars[j - 1].oid, &dec.vars[j].oid);
+        }
+    });
+
+    res["key_cmp"] = measure(pk, [&] {
+        for (int j = 1; j < dec.vars_len; j++) {
+            sink += asn1_cmp_keys({(char *)keys[j - 1].data(), (int)keys[j - 1].size()}, {(char *)keys[j].data(), (int)keys[j].size()});
+        }
+    });
+
+    res["renc_segs"] = measure(pk, [&] {
+        asn1_rbuf_t w;
+        asn1_rbuf_seg_t segs[SNMP_SEND_SEGS];
+        asn1_rbuf_init(&w, out.data(), out.size());
+        asn1_rbuf_segs(&w, segs, SNMP_SEND_SEGS, SNMP_SEND_SEG_MIN);
+        snmp_renc_pdu(&w, &dec);
+    });
+
+    for (int simd = 0; simd < 2; simd++) {
+        asn1_set_simd(simd);
+
+        res[simd ? "oid_simd" : "oid_scalar"] = measure(pk, [&] {
+            for (int j = 0; j < dec.vars_len; j++) {
+                char *o = out.data();
+                int i = 0, l = out.size();
+                asn1_enc_oid(&o, &i, &l, ASN1_OID, &dec.vars[j].oid);
+
+                asn1_oid_t id = {};
+                i = 1;
+                asn1_arena_dec_oid(&arena, o, &i, l, &id);
+            }
+            asn1_arena_reset(&arena);
+        });
+    }
+
+    asn1_set_simd(1);
+
+    snmp_free_pdu(&dec);
+    asn1_arena_free(&arena);
+
+    return res;
+}
+
+// bench_mib looks up ifTable like OIDs, 22 columns of 10000 rows
+static map<string, Result> bench_mib() {
+    map<string, Result> res;
+
+    Packet pk{"mib", ""};
+
+    Trie<int> trie;
+    map<OID, int> tree;
+
+    for (uint32_t col = 1; col <= 22; col++) {
+        for (uint32_t row = 1; row <= 10000; row++) {
+            vector<uint32_t> id = {1, 3, 6, 1, 2, 1, 2, 2, 1, col, row};
+
+            trie.put(id.data(), id.size()) = row;
+            tree[OID(vector<int>(id.begin(), id.end()))] = row;
+        }
+    }
+
+    FlatIndex<int> flat;
+    vector<pair<string, int *>> all;
+
+    for (auto &it : tree) {
+        all.emplace_back(string(it.first.bytes().b, it.first.bytes().len), &it.second);
+    }
+
+    flat.build(all);
+
+    vector<asn1_oid_t> keys;
+    for (int j = 0; j < 1024; j++) {
+        uint32_t id[] = {1, 3, 6, 1, 2, 1, 2, 2, 1, 1 + (uint32_t)rand() % 22, 1 + (uint32_t)rand() % 10000};
+
+        keys.push_back(asn1_crt_oid(id, 11));
+    }
+
+    asn1_arena_t arena;
+    asn1_arena_init(&arena, 1 << 16);
+
+    vector<uint32_t> path;
+    volatile int sink = 0;
+    size_t k = 0;
+
+    res["trie_find"] = measure(pk, [&] {
+        const asn1_oid_t &id = keys[k++ % keys.size()];
+        sink += *trie.find(asn1_oid_arcs(&id), id.len);
+    });
+
+    res["trie_next"] = measure(pk, [&] {
+        const asn1_oid_t &id = keys[k++ % keys.size()];
+        sink += *trie.next(asn1_oid_arcs(&id), id.len, &path);
+    });
+
+    res["map_find"] = measure(pk, [&] {
+        sink += tree.find(OID(keys[k++ % keys.size()], &arena))->second;
+        asn1_arena_reset(&arena);
+    });
+
+    res["map_next"] = measure(pk, [&] {
+        sink += tree.upper_bound(OID(keys[k++ % keys.size()], &arena))->second;
+        asn1_arena_reset(&arena);
+    });
+
+    res["flat_find"] = measure(pk, [&] {
+        sink += *flat.find(OID(keys[k++ % keys.size()], &arena).bytes());
+        asn1_arena_reset(&arena);
+    });
+
+    res["flat_next"] = measure(pk, [&] {
+        asn1_str_t found;
+        sink += *flat.next(OID(keys[k++ % keys.size()], &arena).bytes(), &found);
+        asn1_arena_reset(&arena);
+    });
+
+    // a table walk, each key is the last one found
+    asn1_str_t at = {};
+    size_t slot = 0;
+
+    res["flat_walk"] = measure(pk, [&] {
+        int *v = flat.next(at, &at, &slot);
+        if (v == NULL) {
+            at = {};
+            return;
+        }
+
+        sink += *v;
+    });
+
+    for (asn1_oid_t &id : keys) {
+        asn1_free_oid(&id);
+    }
+
+    asn1_arena_free(&arena);
+
+    return res;
+}
+
+// client sends pk to port on loopback keeping window of them in flight
+// until the time is past end, then waits for the rest. Returns the
+// responses, the requests not answered in a second are counted in lost.
+static long client(const Packet &pk, const char *port, double end, int window, long *lost) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    struct sockaddr_in to = {};
+    to.sin_family = AF_INET;
+    to.sin_port = htons(atoi(port));
+    to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    struct timeval tv = {1, 0};
+
+    if (fd < 0 || connect(fd, (struct sockaddr *)&to, sizeof(to)) != 0 || setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0) {
+        throw runtime_error("connect to workers");
+    }
+
+    char buf[4096];
+    long got = 0;
+    int flight = 0;
+
+    for (;;) {
+        if (flight < window && now() < end) {
+            if (send(fd, pk.data.data(), pk.data.size(), 0) < 0) {
+                throw runtime_error("send request");
+            }
+
+            flight++;
+            continue;
+        }
+
+        if (flight == 0) {
+            break;
+        }
+
+        flight--;
+
+        if (recv(fd, buf, sizeof(buf), 0) < 0) {
+            (*lost)++;
+        } else {
+            got++;
+        }
+    }
+
+    close(fd);
+
+    return got;
+}
+
+// bench_serve has the example MIB answer requests over loopback. The time
+// is mostly the syscalls, the allocations must be zero.
+static map<string, Result> bench_serve(int *bad) {
+    map<string, Result> res;
+
+    const char *port = "16161";
+
+    // blob is a large value lent to the response, not copied
+    struct Blob : public StringRef {
+        string b = string(1000, 'x');
+
+        snmp_str_t operator()() const {
+            return {(char *)b.data(), (int)b.size()};
+        }
+    } blob;
+
+    EasySNMP s;
+    example::Mib mib;
+
+    s.begin();
+    mib.add(s);
+    s.add({{1, 3, 6, 1, 4, 1, 121213, 1, 0}}, &blob);
+    s.commit();
+    s.listen(port);
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    struct sockaddr_in to = {};
+    to.sin_family = AF_INET;
+    to.sin_port = htons(atoi(port));
+    to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (fd < 0 || connect(fd, (struct sockaddr *)&to, sizeof(to)) != 0) {
+        throw runtime_error("connect to serve");
+    }
+
+    vector<uint32_t> descr = {1, 3, 6, 1, 2, 1, 1, 1, 0};
+    vector<uint32_t> uptime = {1, 3, 6, 1, 2, 1, 1, 3, 0};
+    vector<uint32_t> counter = {1, 3, 6, 1, 4, 1, 121212, 1, 1};
+    vector<uint32_t> system = {1, 3, 6, 1, 2, 1, 1};
+    vector<uint32_t> big = {1, 3, 6, 1, 4, 1, 121213, 1, 0};
+
+    vector<Packet> reqs = {
+        query("get_const", SNMP_CMD_GET, {descr}, 0),
+        query("get_var", SNMP_CMD_GET, {uptime, counter}, 0),
+        query("get_next", SNMP_CMD_GET_NEXT, {system, uptime, counter}, 0),
+        query("get_bulk", SNMP_CMD_GET_BULK, {system}, 20),
+        query("get_blob", SNMP_CMD_GET, {big}, 0),
+    };
+
+    char buf[64 << 10];
+
+    for (int frozen = 0; frozen < 2; frozen++) {
+        if (frozen) {
+            s.freeze();
+        }
+
+        for (const Packet &pk : reqs) {
+            string name = pk.name + (frozen ? "_frozen" : "");
+
+            res[name] = measure(pk, [&] {
+                if (send(fd, pk.data.data(), pk.data.size(), 0) < 0) {
+                    throw runtime_error("send request");
+                }
+
+                s.serve();
+
+                if (recv(fd, buf, sizeof(buf), 0) < 0) {
+                    throw runtime_error("recv response");
+                }
+            });
+
+            if (res[name].allocs > 0) {
+                cerr << "serve/" << name << ": " << res[name].allocs << " allocations per request" << endl;
+                (*bad)++;
+            }
+        }
+    }
+
+    // the same requests queued 16 at a time, served one by one and in a
+    // batch. The time is per request.
+    const int queued = 16;
+
+    for (int batched = 0; batched < 2; batched++) {
+        for (const Packet &pk : reqs) {
+            string name = pk.name + (batched ? "_batch16" : "_x16");
+
+            Result r = measure(pk, [&] {
+                for (int k = 0; k < queued; k++) {
+                    if (send(fd, pk.data.data(), pk.data.size(), 0) < 0) {
+                        throw runtime_error("send request");
+                    }
+                }
+
+                for (int k = 0; k < queued;) {
+                    if (batched) {
+                        k += s.serve_batch();
+                    } else {
+                        s.serve();
+                        k++;
+                    }
+                }
+
+                for (int k = 0; k < queued; k++) {
+                    if (recv(fd, buf, sizeof(buf), 0) < 0) {
+                        throw runtime_error("recv response");
+                    }
+                }
+            });
+
+            r.ns /= queued;
+            r.mbs *= queued;
+            r.allocs /= queued;
+
+            res[name] = r;
+
+            if (r.allocs > 0) {
+                cerr << "serve/" << name << ": " << r.allocs << " allocations per request" << endl;
+                (*bad)++;
+            }
+        }
+    }
+
+    // GETBULK with a small max_msg_size: the varbinds that don't fit are
+    // cut from the end, rows whole, and the response is noError. The blob
+    // never fits, the non-repeaters before it are kept.
+    struct Limit {
+        Packet pk;
+        int min, max;  // varbinds
+    };
+
+    vector<uint32_t> before_big = {1, 3, 6, 1, 4, 1, 121213};
+
+    const vector<Limit> limits = {
+        {query("bulk_rows", SNMP_CMD_GET_BULK, {system}, 20), 1, 19},
+        {query("bulk_non_repeater", SNMP_CMD_GET_BULK, {before_big, system}, 20, 1), 0, 0},
+        {query("bulk_second_non_repeater", SNMP_CMD_GET_BULK, {system, before_big, system}, 20, 2), 1, 1},
+        {query("bulk_first_row", SNMP_CMD_GET_BULK, {system, before_big}, 20), 0, 0},
+        {query("bulk_first_row_after", SNMP_CMD_GET_BULK, {system, system, before_big}, 20, 1), 1, 1},
+    };
+
+    s.max_msg_size = 484;
+
+    for (const Limit &l : limits) {
+        if (send(fd, l.pk.data.data(), l.pk.data.size(), 0) < 0) {
+            throw runtime_error("send request");
+        }
+
+        s.serve();
+
+        int n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0) {
+            throw runtime_error("recv response");
+        }
+
+        snmp_pdu_t p = {};
+        int r = snmp_dec_pdu(buf, n, &p);
+
+        bool fits = n <= s.max_msg_size && p.vars_len >= l.min && p.vars_len <= l.max;
+
+        if (r < 0 || p.error_status != SNMP_ERR_OK || !fits) {
+            cerr << "serve/" << l.pk.name << ": status " << p.error_status << ", " << p.vars_len << " varbinds in " << n << " bytes" << endl;
+            (*bad)++;
+        }
+
+        snmp_free_pdu(&p);
+    }
+
+    s.max_msg_size = SNMP_MAX_MSG_SIZE;
+
+    // Workers serving the MIB on another port to as many clients as there
+    // are workers, each with 8 requests in flight. The time is per request
+    // of all of them together, so it drops as they scale over the CPUs.
+    const char *wport = "16162";
+
+    for (int n : {1, 2, 4}) {
+        string name = "workers" + to_string(n);
+
+        Workers w(s, n);
+        w.start(wport);
+
+        long got = 0, lost = 0, answered = 0;
+        long long mallocs = 0;
+        double st = 0;
+
+        // the first round warms up
+        for (int round = 0; round < 2; round++) {
+            vector<thread> cs;
+            vector<long> gots(n), losts(n);
+
+            // the clients wait for go, their threads aren't counted
+            atomic<bool> go{false};
+            double end = 0;
+
+            for (int c = 0; c < n; c++) {
+                cs.emplace_back([&, c] {
+                    while (!go.load()) {
+                        this_thread::yield();
+                    }
+
+                    gots[c] = client(reqs[1], wport, end, 8, &losts[c]);
+                });
+            }
+
+            mallocs = allocs();
+            st = now();
+            end = st + seconds * 1e9 / (round == 0 ? 10 : 1);
+            go = true;
+
+            for (thread &t : cs) {
+                t.join();
+            }
+
+            got = 0;
+            for (int c = 0; c < n; c++) {
+                got += gots[c];
+                lost += losts[c];
+            }
+
+            answered += got;
+        }
+
+        Result r;
+        r.ns = (now() - st) / max(got, 1L);
+        r.mbs = reqs[1].data.size() / r.ns * 1e3;
+        r.allocs = (double)(allocs() - mallocs) / max(got, 1L);
+
+        w.stop();
+
+        res[name] = r;
+
+        EasySNMP::Stats stats = w.stats();
+
+        if (lost > 0 || got == 0 || stats.requests != answered || r.allocs > 0) {
+            cerr << "serve/" << name << ": " << got << " answered, " << lost << " lost, " << stats.requests << " served of " << answered << ", " << r.allocs
+                 << " allocations per request" << endl;
+            (*bad)++;
+        }
+    }
+
+    s.close();
+    close(fd);
+
+    return res;
+}
+
+// report prints res and compares it with old, returns the number of
+// allocation regressions
+static int report(const string &group, int bytes, const map<string, Result> &res, const map<string, Result> &old, map<string, Result> *all) {
+    int bad = 0;
+
+    for (auto &it : res) {
+        string name = group + "/" + it.first;
+        const Result &r = it.second;
+
+        if (!want(name)) {
+            continue;
+        }
+
+        (*all)[name] = r;
+
+        printf("%-22s %6d %12.1f %10.1f %10.2f", name.c_str(), bytes, r.ns, r.mbs, r.allocs);
+
+        auto o = old.find(name);
+        if (o != old.end()) {
+            double d = (r.ns / o->second.ns - 1) * 100;
+
+            printf(" %+6.1f%%", d);
+
+            if (r.allocs > o->second.allocs + 0.005) {
+                printf("  REGRESSION");
+                bad++;
+            } else if (d > tolerance) {
+                printf("  slower");
+            }
+        }
+
+        printf("\n");
+    }
+
+    return bad;
+}
+
+static map<string, Result> load(const char *file) {
+    map<string, Result> res;
+
+    FILE *f = fopen(file, "r");
+    if (f == NULL) {
+        throw runtime_error(string("open ") + file);
+    }
+
+    char line[256], name[128];
+    Result r;
+
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#') {
+            continue;
+        }
+
+        if (sscanf(line, "%127s %lf %lf", name, &r.ns, &r.allocs) == 3) {
+            res[name] = r;
+        }
+    }
+
+    fclose(f);
+
+    return res;
+}
+
+static void save(const char *file, const map<string, Result> &res) {
+    FILE *f = fopen(file, "w");
+    if (f == NULL) {
+        throw runtime_error(string("create ") + file);
+    }
+
+    fprintf(f, "# name ns/packet allocs/packet, written by ./bench -w\n");
+
+    for (auto &it : res) {
+        fprintf(f, "%s %.1f %.2f\n", it.first.c_str(), it.second.ns, it.second.allocs);
+    }
+
+    fclose(f);
+}
+
+int main(int argc, const char *argv[]) {
+    const char *base = NULL;
+    const char *write = NULL;
+    bool checks = false;
+
+    for (int i = 1; i < argc; i++) {
+        string a = argv[i];
+
+        if (i + 1 < argc && a == "-f") {
+            filter = argv[++i];
+        } else if (i + 1 < argc && a == "-b") {
+            base = argv[++i];
+        } else if (i + 1 < argc && a == "-w") {
+            write = argv[++i];
+        } else if (i + 1 < argc && a == "-r") {
+            tolerance = atof(argv[++i]);
+        } else if (i + 1 < argc && a == "-t") {
+            seconds = atof(argv[++i]);
+        } else if (a == "-c") {
+            checks = true;
+        } else {
+            cerr << "usage: " << argv[0] << " [-c] [-f filter] [-b baseline] [-w baseline] [-r percent] [-t seconds]" << endl;
+            return 2;
+        }
+    }
+
+    try {
+        map<string, Result> old;
+        if (base) {
+            old = load(base);
+        }
+
+        map<string, Result> all;
+        int bad = 0;
+
+        if (!checks) {
+            printf("%-22s %6s %12s %10s %10s\n", "bench", "bytes", "ns/packet", "MB/s", "allocs");
+        }
+
+        if (!check_uint()) {
+            bad++;
+        }
+
+        if (!check_simd()) {
+            bad++;
+        }
+
+        if (!check_renc()) {
+            bad++;
+        }
+
+        for (const Packet &pk : corpus()) {
+            if (!runs(pk.name)) {
+                continue;
+            }
+
+            if (!check(pk)) {
+                bad++;
+            }
+
+            if (!checks) {
+                bad += report(pk.name, pk.data.size(), bench(pk), old, &all);
+            }
+        }
+
+        if (!checks && runs("mib")) {
+            bad += report("mib", 0, bench_mib(), old, &all);
+        }
+
+        if (!checks && runs("serve")) {
+            bad += report("serve", 0, bench_serve(&bad), old, &all);
+        }
+
+        if (write && !checks) {
+            // a filtered run replaces only its rows
+            map<string, Result> rows;
+            if (*filter && access(write, F_OK) == 0) {
+                rows = load(write);
+            }
+
+            for (auto &it : all) {
+                rows[it.first] = it.second;
+            }
+
+            save(write, rows);
+        }
+
+        if (bad) {
+            cerr << bad << " failures" << endl;
+            return 1;
+        }
+    } catch (const exception &e) {
+        cerr << "error: " << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -1,11 +1,24 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
 #include <string>
+#include <thread>
 #include <vector>
 
 extern "C" {
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
 
 #include "snmp.h"
 }
@@ -19,7 +32,7 @@ class Var {
     virtual int type() const {
         return 0;
     };
-    virtual void *val() const = 0;
+    virtual snmp_value_t val(asn1_arena_t *a) const = 0;
 };
 
 class String : public Var {
@@ -30,9 +43,15 @@ class String : public Var {
         return ASN1_OCT_STR;
     }
 
-    void *val() const {
+    snmp_value_t val(asn1_arena_t *a) const {
         string v = this->operator()();
-        return asn1_new_str(v.c_str(), 0);
+
+        snmp_value_t r;
+        if (snmp_arena_set_str(a, &r, v.data(), v.size())) {
+            throw bad_alloc();
+        }
+
+        return r;
     }
 };
 
@@ -44,9 +63,10 @@ class Int : public Var {
         return ASN1_INT;
     }
 
-    void *val() const {
-        int v = this->operator()();
-        return snmp_new_int(v);
+    snmp_value_t val(asn1_arena_t *a) const {
+        snmp_value_t r;
+        r.i = this->operator()();
+        return r;
     }
 };
 
@@ -58,9 +78,10 @@ class Int64 : public Var {
         return SNMP_TP_INT64;  // not supported by some implementations
     }
 
-    void *val() const {
-        long long v = this->operator()();
-        return snmp_new_long(v);
+    snmp_value_t val(asn1_arena_t *a) const {
+        snmp_value_t r;
+        r.l = this->operator()();
+        return r;
     }
 };
 
@@ -72,226 +93,2114 @@ class ObjectID : public Var {
         return ASN1_OID;
     }
 
-    void *val() const {
+    snmp_value_t val(asn1_arena_t *a) const {
         vector<int> v = this->operator()();
-        return asn1_new_oid(v.data(), v.size());
+
+        snmp_value_t r;
+        if (snmp_arena_set_oid(a, &r, (const uint32_t *)v.data(), v.size())) {
+            throw bad_alloc();
+        }
+
+        return r;
     }
 };
 
-class OID {
-    asn1_oid_t oid;
+// StringRef is a String lending its bytes instead of returning a copy.
+// They must stay valid and unchanged until the response is sent, that is
+// until the serve call asking for them returns. Values of SNMP_SEND_SEG_MIN
+// bytes or more then go to the socket from where they are, so the only
+// copy is the one into the datagram.
+class StringRef : public Var {
+   public:
+    virtual snmp_str_t operator()() const = 0;
+
+    int type() const {
+        return ASN1_OCT_STR;
+    }
+
+    // val borrows the bytes when a is set, the request arena lives no
+    // longer than the response. Without one it copies them to the heap.
+    snmp_value_t val(asn1_arena_t *a) const {
+        snmp_str_t v = this->operator()();
+
+        snmp_value_t r;
+        if (a == NULL || v.len <= SNMP_STR_INLINE) {
+            if (snmp_arena_set_str(a, &r, v.b, v.len)) {
+                throw bad_alloc();
+            }
 
+            return r;
+        }
+
+        r.s.len = v.len;
+        r.s.ext = v.b;
+
+        return r;
+    }
+};
+
+// ObjectIDRef is an ObjectID lending an OID it keeps, with the same
+// lifetime rules as StringRef
+class ObjectIDRef : public Var {
    public:
-    OID(const OID &b) {
-        oid = asn1_crt_oid(b.oid.b, b.oid.len);
+    virtual const asn1_oid_t &operator()() const = 0;
+
+    int type() const {
+        return ASN1_OID;
     }
 
-    OID(const vector<int> v) {
-        oid = asn1_crt_oid(v.data(), v.size());
+    snmp_value_t val(asn1_arena_t *a) const {
+        const asn1_oid_t &v = this->operator()();
+
+        snmp_value_t r;
+        if (a == NULL) {
+            if (snmp_arena_set_oid(NULL, &r, asn1_oid_arcs(&v), v.len)) {
+                throw bad_alloc();
+            }
+
+            return r;
+        }
+
+        r.oid = const_cast<asn1_oid_t *>(&v);
+
+        return r;
     }
+};
+
+// Metric is a number the application keeps up to date itself with relaxed
+// atomics. The agent reads it when responding, with no callback and no
+// malloc. Each cell has its own cache line. A sharded metric has several
+// cells summed on read, so threads bumping it don't fight for one line.
+class Metric {
+   protected:
+    struct alignas(64) Cell {
+        atomic<uint64_t> v{0};
+    };
 
-    OID(asn1_oid_t v) {
-        oid = asn1_crt_oid(v.b, v.len);
+    Cell *cells;
+    int shards;
+    uint64_t mask;
+
+    Metric(int type, int bits, Cell *cells, int shards)
+        : cells(cells), shards(shards), mask(bits == 64 ? ~0ULL : (1ULL << bits) - 1), type(type) {}
+
+    // cell is the one of the calling thread
+    Cell &cell() {
+        static atomic<int> threads{0};
+        static thread_local int k = threads++;
+
+        return cells[shards == 1 ? 0 : k % shards];
     }
 
-    ~OID() {
-        asn1_free_oid(&oid);
+   public:
+    const int type;
+
+    Metric(const Metric &) = delete;
+    Metric &operator=(const Metric &) = delete;
+
+    uint64_t get() const {
+        uint64_t v = 0;
+
+        for (int k = 0; k < shards; k++) {
+            v += cells[k].v.load(memory_order_relaxed);
+        }
+
+        return v & mask;
     }
 
-    bool operator<(const OID b) const {
-        return asn1_cmp_oids(oid, b.oid) < 0;
+    // val is the value as snmp_enc_value wants it
+    snmp_value_t val() const {
+        snmp_value_t r;
+
+        if (type == SNMP_TP_COUNTER || type == SNMP_TP_GAUGE) {
+            r.i = (int)(uint32_t)get();
+        } else {
+            r.l = (long long)get();
+        }
+
+        return r;
     }
+};
+
+template <int TP, int BITS, int SHARDS>
+class Cells : public Metric {
+    Cell own[SHARDS];
+
+   public:
+    Cells() : Metric(TP, BITS, own, SHARDS) {}
 
-    bool operator==(const OID b) const {
-        return asn1_cmp_oids(oid, b.oid) == 0;
+    // add wraps around like the counters do
+    void add(uint64_t d = 1) {
+        cell().v.fetch_add(d, memory_order_relaxed);
     }
+};
 
-    operator asn1_oid_t() const {
-        return asn1_crt_oid(oid.b, oid.len);
+template <int TP>
+class Settable : public Cells<TP, 32, 1> {
+   public:
+    void set(uint32_t x) {
+        this->cell().v.store(x, memory_order_relaxed);
     }
 };
 
-class EasySNMP {
-    int fd = -1;
-    map<OID, Var *> oids;
+class Counter32 : public Cells<SNMP_TP_COUNTER, 32, 1> {};
+class Counter64 : public Cells<SNMP_TP_COUNTER64, 64, 1> {};
+class Gauge32 : public Settable<SNMP_TP_GAUGE> {};
+class TimeTicks : public Settable<SNMP_TP_TIMETICKS> {};
+
+template <int N>
+class ShardedCounter32 : public Cells<SNMP_TP_COUNTER, 32, N> {};
+
+template <int N>
+class ShardedCounter64 : public Cells<SNMP_TP_COUNTER64, 64, N> {};
 
+// Subtree answers for all the oids under the root it is added at, so a
+// region of the MIB can be backed by any data structure
+class Subtree {
    public:
-    void listen(string addr) {
-        fd = snmp_bind_addr(addr.c_str());
-        if (fd < 0) {
-            throw logic_error("can't bind");
+    virtual ~Subtree() {}
+
+    // get puts the value at id made in a to val and returns its type, 0 if
+    // there is nothing there. id is under root.
+    virtual int get(const asn1_oid_t &root, const asn1_oid_t &id, asn1_arena_t *a, snmp_value_t *val) const = 0;
+
+    // next puts the first oid after id to res and its value to val, both
+    // made in a, and returns its type, 0 if there is none under root.
+    // id is under root or before it.
+    virtual int next(const asn1_oid_t &root, const asn1_oid_t &id, asn1_arena_t *a, asn1_oid_t *res, snmp_value_t *val) const = 0;
+};
+
+// Table serves a conceptual table without a Var per cell. The cell of
+// column c at row index i is at root.c.i, where root is the table entry
+// oid. Cells are asked for on request only.
+class Table : public Subtree {
+   public:
+    typedef vector<uint32_t> Index;
+
+    // columns lists the column numbers in increasing order
+    virtual const vector<uint32_t> &columns() const = 0;
+
+    // next_index replaces idx by the first row index after it in OID order,
+    // by the first one if idx is empty. idx is any list of arcs, not
+    // necessary an existing row. Returns false if there are no more rows.
+    virtual bool next_index(Index *idx) const = 0;
+
+    // cell puts the value of column col at row idx made in a to val and
+    // returns its type, 0 if there is no such cell
+    virtual int cell(uint32_t col, const Index &idx, asn1_arena_t *a, snmp_value_t *val) const = 0;
+
+    int get(const asn1_oid_t &root, const asn1_oid_t &id, asn1_arena_t *a, snmp_value_t *val) const {
+        static thread_local Index row;
+
+        if (id.len < root.len + 2) {
+            return 0;
         }
-    }
 
-    void resp_get(snmp_pdu_t *p) {
-        if (p->vars_len == 0) {
-            snmp_add_error(p, 1, "empty request");
-            return;
+        const uint32_t *x = asn1_oid_arcs(&id) + root.len;
+        const vector<uint32_t> &cols = columns();
+
+        if (!binary_search(cols.begin(), cols.end(), x[0])) {
+            return 0;
         }
 
-        for (int j = 0; j < p->vars_len; j++) {
-            snmp_var_t *v = &p->vars[j];
+        row.assign(x + 1, x + id.len - root.len);
 
-            snmp_free_var_value(v);
+        return cell(x[0], row, a, val);
+    }
 
-            auto it = oids.find(v->oid);
-            if (it == oids.end()) {
-                v->type = SNMP_TP_NO_SUCH_OBJ;
-                //  snmp_add_error(p, SNMP_ERR_NO_SUCH_NAME, "no such variable");
-                continue;
+    int next(const asn1_oid_t &root, const asn1_oid_t &id, asn1_arena_t *a, asn1_oid_t *res, snmp_value_t *val) const {
+        static thread_local Index row;
+        static thread_local vector<uint32_t> arcs;
+
+        const vector<uint32_t> &cols = columns();
+        auto c = cols.begin();
+
+        row.clear();
+
+        if (id.len > root.len && asn1_oid_has_prefix(&id, &root)) {
+            const uint32_t *x = asn1_oid_arcs(&id) + root.len;
+
+            c = lower_bound(cols.begin(), cols.end(), x[0]);
+            if (c != cols.end() && *c == x[0]) {
+                row.assign(x + 1, x + id.len - root.len);
             }
+        }
+
+        for (; c != cols.end(); ++c, row.clear()) {
+            while (next_index(&row)) {
+                int tp = cell(*c, row, a, val);
+                if (tp == 0) {
+                    continue;  // a hole in the column
+                }
+
+                arcs.assign(asn1_oid_arcs(&root), asn1_oid_arcs(&root) + root.len);
+                arcs.push_back(*c);
+                arcs.insert(arcs.end(), row.begin(), row.end());
 
-            const Var *var = it->second;
+                *res = asn1_arena_crt_oid(a, arcs.data(), arcs.size());
 
-            v->type = var->type();
-            v->value = var->val();
+                return tp;
+            }
         }
+
+        return 0;
     }
+};
 
-    void resp_get_next(snmp_pdu_t *p) {
-        if (p->vars_len == 0) {
-            snmp_add_error(p, 1, "empty request");
-            return;
-        }
+// Sampler takes the values of vars on a schedule in background threads,
+// so a slow var never holds up serving. Readers get the last value taken,
+// already encoded.
+class Sampler {
+   public:
+    struct Sample {
+        int type;
+        string enc;
+    };
 
-        asn1_oid_t first = p->vars[0].oid;
+    typedef chrono::steady_clock Clock;
 
-        auto it = oids.upper_bound(first);
-        if (it == oids.end()) {
-            p->vars[0].type = SNMP_TP_END_OF_MIB_VIEW;
-            return;
+    struct Job {
+        Var *var;
+        Clock::duration period;
+        Clock::time_point due;
+        shared_ptr<const Sample> last;  // accessed atomically
+
+        bool busy = false;     // being taken
+        bool removed = false;  // never taken again
+
+        shared_ptr<const Sample> get() const {
+            return atomic_load(&last);
+        }
+    };
+
+   private:
+    struct Later {
+        bool operator()(const Job *a, const Job *b) const {
+            return a->due > b->due;
         }
+    };
+
+    vector<unique_ptr<Job>> jobs;
+    priority_queue<Job *, vector<Job *>, Later> queue;  // by due
 
-        snmp_free_pdu_vars(p);
+    mutex mu;
+    condition_variable wake;
+    condition_variable done;  // a job is taken
+    vector<thread> workers;
+    bool stopping = false;
 
-        asn1_oid_t oid = it->first;
-        int type = it->second->type();
-        void *val = it->second->val();
+    static shared_ptr<const Sample> take(Var *v) {
+        auto s = make_shared<Sample>();
 
-        if (type == 0) {
+        s->type = v->type();
+        if (s->type == 0) {
             throw logic_error("bad var");
         }
 
-        snmp_add_var(p, oid, type, val);
-    }
+        snmp_var_t val = {};
+        val.type = s->type;
+        val.value = v->val(NULL);
 
-    void resp_get_bulk(snmp_pdu_t *p) {
-        if (p->vars_len == 0) {
-            snmp_add_error(p, 1, "empty request");
-            return;
+        char *b = NULL;
+        int i = 0, l = 0;
+
+        int r = snmp_enc_value(&b, &i, &l, s->type, &val.value);
+        if (r == 0) {
+            s->enc.assign(b, i);
         }
 
-        asn1_oid_t first = p->vars[0].oid;
-        first = asn1_crt_oid(first.b, first.len);
+        asn1_release(NULL, b);
+        snmp_free_var_value(&val);
 
-        auto it = oids.upper_bound(first);
-        if (it == oids.end()) {
-            snmp_add_var(p, first, SNMP_TP_END_OF_MIB_VIEW, NULL);
-            goto error;
+        if (r) {
+            throw logic_error("can't encode var");
         }
 
-        snmp_free_pdu_vars(p);
+        return s;
+    }
 
-        try {
-            for (; it != oids.end(); it++) {
-                asn1_oid_t oid = it->first;
+    void work() {
+        unique_lock<mutex> lock(mu);
 
-                int type = it->second->type();
-                void *val = it->second->val();
+        while (!stopping) {
+            if (queue.empty()) {
+                wake.wait(lock);
+                continue;
+            }
 
-                if (type == 0) {
-                    asn1_free_oid(&oid);
-                    throw logic_error("bad var");
-                }
+            Job *j = queue.top();
+            if (Clock::now() < j->due) {
+                wake.wait_until(lock, j->due);
+                continue;
+            }
 
-                snmp_add_var(p, oid, type, val);
+            // the job is off the queue while it's sampled, so a var is
+            // never called from two threads at once
+            queue.pop();
 
-                if (p->vars_len >= p->max_repetitions) {
-                    break;
-                }
+            if (j->removed) {
+                continue;
             }
 
-            if (it == oids.end() && p->vars_len < p->max_repetitions) {
-                asn1_oid_t last = p->vars[p->vars_len - 1].oid;
-                snmp_add_var(p, asn1_crt_oid(last.b, last.len), SNMP_TP_END_OF_MIB_VIEW, NULL);
+            j->busy = true;
+            lock.unlock();
+
+            try {
+                atomic_store(&j->last, take(j->var));
+            } catch (...) {
+                // the last good value is kept
             }
-        } catch (...) {
-            asn1_free_oid(&first);
 
-            throw;
+            lock.lock();
+
+            j->busy = false;
+            done.notify_all();
+
+            if (j->removed) {
+                continue;
+            }
+
+            j->due = max(j->due + j->period, Clock::now());
+            queue.push(j);
         }
+    }
 
-    error:
-        asn1_free_oid(&first);
+   public:
+    Sampler() = default;
+    Sampler(const Sampler &) = delete;
+    Sampler &operator=(const Sampler &) = delete;
+
+    ~Sampler() {
+        stop();
     }
 
-    void serve() {
-        snmp_pdu_t p = {};
+    // add schedules v to be taken every period_ms. The first value is
+    // taken here, so there is always one to read.
+    const Job *add(Var *v, int period_ms) {
+        unique_ptr<Job> j(new Job());
+        j->var = v;
+        j->period = chrono::milliseconds(period_ms);
+        j->last = take(v);
+        j->due = Clock::now() + j->period;
 
-        try {
-            int r = snmp_recv_pdu(fd, &p);
-            if (r < 0) {
-                if (p.error.code == 0) {
-                    perror("recv pdu error, errno:");
-                    throw logic_error("read error");
-                } else {
-                    cerr << "recv pdu: " << p.error.message << endl;
-                }
+        lock_guard<mutex> lock(mu);
+
+        jobs.push_back(move(j));
+        queue.push(jobs.back().get());
+        wake.notify_one();
+
+        return jobs.back().get();
+    }
+
+    // remove stops taking j, its var isn't used anymore once it returns.
+    // The last value stays readable.
+    void remove(const Job *j) {
+        unique_lock<mutex> lock(mu);
+
+        Job *m = const_cast<Job *>(j);
+        m->removed = true;
+
+        while (m->busy) {
+            done.wait(lock);
+        }
+    }
+
+    // start runs n worker threads
+    void start(int n) {
+        lock_guard<mutex> lock(mu);
+
+        stopping = false;
+
+        for (int k = 0; k < n; k++) {
+            workers.emplace_back(&Sampler::work, this);
+        }
+    }
+
+    void stop() {
+        {
+            lock_guard<mutex> lock(mu);
+            stopping = true;
+            wake.notify_all();
+        }
+
+        for (thread &t : workers) {
+            t.join();
+        }
+
+        workers.clear();
+    }
+};
+
+// OID is compared by its key (see asn1_oid_key), which is a memcmp
+class OID {
+    asn1_oid_t oid;
+    asn1_str_t key;
+    bool owned = true;
+
+    void make_key(asn1_arena_t *a) {
+        key.b = (char *)asn1_alloc(a, ASN1_OID_KEY_MAX(oid.len));
+        key.len = asn1_oid_key(&oid, key.b, ASN1_OID_KEY_MAX(oid.len));
+    }
+
+   public:
+    OID(const OID &b) {
+        oid = asn1_crt_oid(asn1_oid_arcs(&b.oid), b.oid.len);
+        make_key(NULL);
+    }
+
+    OID(const vector<int> v) {
+        oid = asn1_crt_oid((const uint32_t *)v.data(), v.size());
+        make_key(NULL);
+    }
+
+    OID(const asn1_oid_t &v) {
+        oid = asn1_crt_oid(asn1_oid_arcs(&v), v.len);
+        make_key(NULL);
+    }
+
+    // OID(v, a) borrows v and makes the key in a, for lookups
+    OID(const asn1_oid_t &v, asn1_arena_t *a) : oid(v), owned(false) {
+        make_key(a);
+    }
+
+    ~OID() {
+        if (owned) {
+            asn1_free_oid(&oid);
+            asn1_free_str(&key);
+        }
+    }
+
+    bool operator<(const OID &b) const {
+        return asn1_cmp_keys(key, b.key) < 0;
+    }
+
+    bool operator==(const OID &b) const {
+        return asn1_cmp_keys(key, b.key) == 0;
+    }
+
+    bool has_prefix(const OID &b) const {
+        return asn1_key_has_prefix(key, b.key);
+    }
+
+    operator asn1_oid_t() const {
+        return asn1_crt_oid(asn1_oid_arcs(&oid), oid.len);
+    }
+
+    asn1_oid_t crt(asn1_arena_t *a) const {
+        return asn1_arena_crt_oid(a, asn1_oid_arcs(&oid), oid.len);
+    }
 
-                snmp_free_pdu_vars(&p);
-                snmp_add_error(&p, p.error.code, p.error.message);
+    // ref is borrowed, valid while the OID is
+    const asn1_oid_t &ref() const {
+        return oid;
+    }
+
+    // key is borrowed too
+    asn1_str_t bytes() const {
+        return key;
+    }
+};
 
-                goto respond;
+// Trie maps OIDs to T. Chains of single child nodes are merged into one
+// edge of several arcs, so shared prefixes are stored once. Lookups take
+// time proportional to the OID length.
+template <typename T>
+class Trie {
+    struct Node {
+        vector<uint32_t> arcs;    // edge from the parent
+        vector<Node *> kids;      // ordered by arcs[0]
+        vector<uint32_t> firsts;  // arcs[0] of kids, searched without touching them
+        bool has = false;
+        T val;
+
+        ~Node() {
+            for (Node *k : kids) {
+                delete k;
             }
+        }
 
-            snmp_dump_pdu("got ", &p);
+        // kid returns the position of the first kid with arcs[0] >= a
+        size_t kid(uint32_t a) const {
+            return lower_bound(firsts.begin(), firsts.end(), a) - firsts.begin();
+        }
+    };
 
-            switch (p.command) {
-            case SNMP_CMD_GET:
-                resp_get(&p);
-                break;
-            case SNMP_CMD_GET_NEXT:
-                resp_get_next(&p);
-                break;
-            case SNMP_CMD_GET_BULK:
-                resp_get_bulk(&p);
-                break;
-            default:
-                snmp_free_pdu_vars(&p);
-                snmp_add_error(&p, SNMP_ERR_GENERAL, "unsupported command");
-                break;
+    Node root;
+    size_t n = 0;
+
+    // first finds the first value in n's subtree, n included
+    static Node *first(Node *n, vector<uint32_t> *path) {
+        path->insert(path->end(), n->arcs.begin(), n->arcs.end());
+
+        if (n->has) {
+            return n;
+        }
+
+        for (Node *k : n->kids) {
+            Node *r = first(k, path);
+            if (r) {
+                return r;
             }
+        }
 
-        respond:
-            p.command = SNMP_CMD_RESPONSE;
+        path->resize(path->size() - n->arcs.size());
 
-            r = snmp_send_pdu(fd, &p);
-            snmp_dump_pdu("send", &p);
-            if (r < 0) {
-                if (p.error.code == 0) {
-                    perror("send pdu error, errno:");
-                    snmp_dump_pdu(NULL, &p);
-                    throw logic_error("send response");
-                } else {
-                    cerr << "send pdu: " << p.error.message << endl;
-                    snmp_dump_pdu(NULL, &p);
+        return NULL;
+    }
+
+    // next finds the first value after a in n's subtree, n's edge is
+    // already matched and is in path
+    static Node *next(Node *n, const uint32_t *a, int len, vector<uint32_t> *path) {
+        size_t j = 0;
+
+        if (len > 0) {
+            j = n->kid(a[0]);
+
+            if (j < n->kids.size() && n->firsts[j] == a[0]) {
+                Node *k = n->kids[j];
+                int kl = k->arcs.size();
+
+                int m = 0;
+                while (m < kl && m < len && k->arcs[m] == a[m]) {
+                    m++;
+                }
+
+                Node *r = NULL;
+
+                if (m == kl) {
+                    path->insert(path->end(), k->arcs.begin(), k->arcs.end());
+
+                    r = next(k, a + kl, len - kl, path);
+                    if (r == NULL) {
+                        path->resize(path->size() - kl);
+                    }
+                } else if (m == len || k->arcs[m] > a[m]) {
+                    r = first(k, path);
+                }
+
+                if (r) {
+                    return r;
                 }
+
+                j++;
             }
-        } catch (...) {
-            snmp_free_pdu(&p);
+        }
 
-            throw;
+        for (; j < n->kids.size(); j++) {
+            Node *r = first(n->kids[j], path);
+            if (r) {
+                return r;
+            }
         }
 
-        snmp_free_pdu(&p);
+        return NULL;
     }
 
-    void close() {
-        snmp_close(fd);
+    static void copy(Node *d, const Node *s) {
+        d->arcs = s->arcs;
+        d->firsts = s->firsts;
+        d->has = s->has;
+        d->val = s->val;
+
+        for (const Node *k : s->kids) {
+            d->kids.push_back(new Node);
+            copy(d->kids.back(), k);
+        }
     }
 
-    void add(const OID &oid, Var *cb) {
-        oids[oid] = cb;
+    Node *node(const uint32_t *a, int len) {
+        Node *n = &root;
+
+        while (len > 0) {
+            size_t j = n->kid(a[0]);
+            if (j == n->kids.size() || n->firsts[j] != a[0]) {
+                return NULL;
+            }
+
+            Node *k = n->kids[j];
+            int kl = k->arcs.size();
+
+            if (kl > len || !equal(k->arcs.begin(), k->arcs.end(), a)) {
+                return NULL;
+            }
+
+            n = k;
+            a += kl;
+            len -= kl;
+        }
+
+        return n;
     }
-};
+
+    template <typename F>
+    static void each(Node *n, vector<uint32_t> *path, F &f) {
+        path->insert(path->end(), n->arcs.begin(), n->arcs.end());
+
+        if (n->has) {
+            f(*path, n->val);
+        }
+
+        for (Node *k : n->kids) {
+            each(k, path, f);
+        }
+
+        path->resize(path->size() - n->arcs.size());
+    }
+
+   public:
+    Trie() = default;
+
+    Trie(const Trie &b) : n(b.n) {
+        copy(&root, &b.root);
+    }
+
+    Trie &operator=(const Trie &) = delete;
+
+    size_t size() const {
+        return n;
+    }
+
+    // put returns the value at a, it's created if there was none
+    T &put(const uint32_t *a, int len) {
+        Node *n = &root;
+
+        while (len > 0) {
+            size_t j = n->kid(a[0]);
+
+            if (j == n->kids.size() || n->firsts[j] != a[0]) {
+                Node *k = new Node;
+                k->arcs.assign(a, a + len);
+
+                n->kids.insert(n->kids.begin() + j, k);
+                n->firsts.insert(n->firsts.begin() + j, a[0]);
+                n = k;
+
+                break;
+            }
+
+            Node *k = n->kids[j];
+            int kl = k->arcs.size();
+
+            int m = 0;
+            while (m < kl && m < len && k->arcs[m] == a[m]) {
+                m++;
+            }
+
+            if (m < kl) {
+                // split the edge at m
+                Node *mid = new Node;
+                mid->arcs.assign(k->arcs.begin(), k->arcs.begin() + m);
+                mid->kids.push_back(k);
+
+                k->arcs.erase(k->arcs.begin(), k->arcs.begin() + m);
+                mid->firsts.push_back(k->arcs[0]);
+
+                n->kids[j] = mid;
+                k = mid;
+            }
+
+            n = k;
+            a += m;
+            len -= m;
+        }
+
+        if (!n->has) {
+            n->has = true;
+            this->n++;
+        }
+
+        return n->val;
+    }
+
+    T *find(const uint32_t *a, int len) {
+        Node *n = node(a, len);
+
+        return n && n->has ? &n->val : NULL;
+    }
+
+    // erase removes the value at a, the nodes are kept
+    bool erase(const uint32_t *a, int len) {
+        Node *n = node(a, len);
+        if (n == NULL || !n->has) {
+            return false;
+        }
+
+        n->has = false;
+        n->val = T();
+        this->n--;
+
+        return true;
+    }
+
+    // each calls f(path, value) for all the values in OID order
+    template <typename F>
+    void each(F f) {
+        vector<uint32_t> path;
+
+        each(&root, &path, f);
+    }
+
+    // next returns the first value after a in OID order and puts its OID
+    // to path, NULL if there is none
+    T *next(const uint32_t *a, int len, vector<uint32_t> *path) {
+        path->clear();
+
+        Node *r = next(&root, a, len, path);
+
+        return r ? &r->val : NULL;
+    }
+};
+
+// FlatIndex is a read only sorted set of OID keys (see asn1_oid_key)
+// pointing to T. Slots are in Eytzinger order: the children of slot k are
+// 2k and 2k+1, so a search goes down the array and the next levels can be
+// prefetched. The search only touches the heads: the first 16 key bytes
+// as big endian integers, four to a cache line. The rest of a key is
+// looked at when the heads are equal.
+template <typename T>
+class FlatIndex {
+    struct Head {
+        uint64_t hi, lo;  // zero padded
+    };
+
+    struct Slot {
+        int len;
+        int off;  // of the key in keys
+        T *val;
+    };
+
+    vector<Head> heads;  // 1 based, in Eytzinger order
+    vector<Slot> slots;  // same order
+    string keys;
+
+    static uint64_t load(asn1_str_t k, int at) {
+        unsigned char b[8] = {};
+        if (k.len > at) {
+            memcpy(b, k.b + at, min(8, k.len - at));
+        }
+
+        uint64_t v = 0;
+        for (unsigned char c : b) {
+            v = v << 8 | c;
+        }
+
+        return v;
+    }
+
+    asn1_str_t key(size_t j) const {
+        return {(char *)keys.data() + slots[j].off, slots[j].len};
+    }
+
+    // search returns the first slot with key > k, or >= k if eq, 0 if none
+    size_t search(asn1_str_t k, bool eq) const {
+        Head h = {load(k, 0), load(k, 8)};
+        size_t n = size();
+        size_t j = 1;
+
+        while (j <= n) {
+            // four levels down, the last slot once past the end
+            __builtin_prefetch(heads.data() + min(16 * j, n));
+
+            const Head &s = heads[j];
+
+            // the heads are compared with bitwise ops, without branches.
+            // Only equal heads, rare but for the key searched, branch off
+            // to compare the whole keys.
+            bool right = (s.hi < h.hi) | ((s.hi == h.hi) & (s.lo < h.lo));
+
+            if ((s.hi == h.hi) & (s.lo == h.lo)) {
+                int r = asn1_cmp_keys(key(j), k);
+                right = r < 0 || (!eq && r == 0);
+            }
+
+            j = 2 * j + right;
+        }
+
+        // up the path to the last left turn
+        return j >> __builtin_ffsl(~j);
+    }
+
+    // succ returns the slot after j in key order, 0 if j is the last
+    size_t succ(size_t j) const {
+        size_t n = heads.size() - 1;
+
+        if (2 * j + 1 <= n) {
+            // the leftmost of the right subtree
+            for (j = 2 * j + 1; 2 * j <= n; j = 2 * j) {
+            }
+
+            return j;
+        }
+
+        return j >> __builtin_ffsl(~j);
+    }
+
+    template <typename I>
+    void fill(I &it, size_t j) {
+        if (j >= slots.size()) {
+            return;
+        }
+
+        fill(it, 2 * j);
+
+        asn1_str_t k = {(char *)it->first.data(), (int)it->first.size()};
+        heads[j] = {load(k, 0), load(k, 8)};
+        slots[j] = {k.len, (int)keys.size(), it->second};
+
+        keys.append(it->first);
+        ++it;
+
+        fill(it, 2 * j + 1);
+    }
+
+   public:
+    size_t size() const {
+        return slots.empty() ? 0 : slots.size() - 1;
+    }
+
+    // build takes (key, value) pairs ordered by key
+    void build(const vector<pair<string, T *>> &all) {
+        size_t total = 0;
+        for (auto &it : all) {
+            total += it.first.size();
+        }
+
+        heads.assign(all.size() + 1, Head());
+        slots.assign(all.size() + 1, Slot());
+        keys.clear();
+        keys.reserve(total);
+
+        auto it = all.begin();
+        fill(it, 1);
+    }
+
+    void clear() {
+        heads.clear();
+        slots.clear();
+        keys.clear();
+    }
+
+    T *find(asn1_str_t k) const {
+        size_t j = search(k, true);
+        if (j == 0 || asn1_cmp_keys(key(j), k) != 0) {
+            return NULL;
+        }
+
+        return slots[j].val;
+    }
+
+    // next returns the first value with the key after k and puts the key
+    // to found, NULL if there is none
+    T *next(asn1_str_t k, asn1_str_t *found) const {
+        size_t at = 0;
+
+        return next(k, found, &at);
+    }
+
+    // next is the same for keys coming in order. at is the slot found for
+    // the previous key, or 0 to search. Keys close to the previous one are
+    // reached by stepping forward instead of searching from the top.
+    T *next(asn1_str_t k, asn1_str_t *found, size_t *at) const {
+        size_t j = *at;
+        if (j == 0) {
+            j = search(k, false);
+        }
+
+        for (int s = 0; j != 0 && asn1_cmp_keys(key(j), k) <= 0; s++) {
+            j = s < 4 ? succ(j) : search(k, false);
+        }
+
+        *at = j;
+        if (j == 0) {
+            return NULL;
+        }
+
+        *found = key(j);
+
+        return slots[j].val;
+    }
+};
+
+// Rcu publishes versions of T. Readers pin the current version without
+// locks or waiting, writers change a copy and publish it at once. A
+// replaced version is deleted when no reader which could have seen it is
+// still in.
+//
+// Until the first reader comes writers change the current version in
+// place, so filling it up front costs no copies. The first lock waits for
+// the writer in, if any, and calls ready.
+//
+// Each reader announces the epoch it entered at in a slot, a version
+// retired at epoch e is only seen by readers announced before e.
+template <typename T>
+class Rcu {
+    static const int READERS = 64;
+
+    struct alignas(64) Slot {
+        atomic<uint64_t> epoch{0};  // 0 if free
+    };
+
+    Slot slots[READERS];
+    atomic<uint64_t> epoch{1};
+    atomic<T *> cur;
+    atomic<bool> published{false};  // a reader came, cur isn't changed anymore
+
+    recursive_mutex mu;  // of writers
+    T *draft = NULL;
+    int depth = 0;
+    bool dirty = false;  // cur was changed in place, not ready
+    vector<pair<uint64_t, T *>> retired;
+
+    void reclaim() {
+        uint64_t min = UINT64_MAX;
+
+        for (Slot &s : slots) {
+            uint64_t e = s.epoch.load();
+            if (e != 0 && e < min) {
+                min = e;
+            }
+        }
+
+        auto keep = retired.begin();
+
+        for (auto &it : retired) {
+            if (it.first <= min) {
+                delete it.second;
+            } else {
+                *keep++ = it;
+            }
+        }
+
+        retired.erase(keep, retired.end());
+    }
+
+   public:
+    Rcu() : cur(new T()) {}
+
+    Rcu(const Rcu &) = delete;
+    Rcu &operator=(const Rcu &) = delete;
+
+    ~Rcu() {
+        if (draft != cur.load()) {
+            delete draft;
+        }
+
+        delete cur.load();
+
+        for (auto &it : retired) {
+            delete it.second;
+        }
+    }
+
+    // lock pins the current version until unlock(slot)
+    T *lock(int *slot) {
+        if (!published.load()) {
+            lock_guard<recursive_mutex> g(mu);
+
+            if (dirty) {
+                cur.load()->ready();
+                dirty = false;
+            }
+
+            published = true;
+        }
+
+        for (;;) {
+            for (int k = 0; k < READERS; k++) {
+                uint64_t free = 0;
+
+                if (slots[k].epoch.compare_exchange_strong(free, epoch.load())) {
+                    *slot = k;
+                    return cur.load();
+                }
+            }
+
+            this_thread::yield();  // more than READERS readers in
+        }
+    }
+
+    void unlock(int slot) {
+        slots[slot].epoch.store(0);
+    }
+
+    // begin returns the copy of the current version to change, the
+    // version itself before the first reader. Changes nest, the copy is
+    // published by the outermost commit.
+    T *begin() {
+        mu.lock();
+
+        if (depth++ == 0) {
+            draft = published ? new T(*cur.load()) : cur.load();
+        }
+
+        return draft;
+    }
+
+    // commit publishes the changed copy calling its ready first
+    void commit() {
+        if (--depth == 0 && draft == cur.load()) {
+            dirty = true;  // ready is left to the first reader
+            draft = NULL;
+        } else if (depth == 0) {
+            draft->ready();
+
+            T *old = cur.exchange(draft);
+            draft = NULL;
+
+            // readers entering from now on see the new version
+            retired.emplace_back(epoch.fetch_add(1) + 1, old);
+
+            reclaim();
+        }
+
+        mu.unlock();
+    }
+
+    // synchronize waits until the readers which could have seen a version
+    // replaced before the call are out, then deletes the versions no one
+    // sees. A reader calling it waits for itself forever.
+    void synchronize() {
+        uint64_t e = epoch.load();
+
+        for (Slot &s : slots) {
+            for (;;) {
+                uint64_t x = s.epoch.load();
+                if (x == 0 || x >= e) {
+                    break;
+                }
+
+                this_thread::yield();
+            }
+        }
+
+        lock_guard<recursive_mutex> g(mu);
+        reclaim();
+    }
+};
+
+// ReadError is thrown by serve and serve_batch when the socket can't be
+// read, serving it again won't help
+class ReadError : public logic_error {
+   public:
+    ReadError() : logic_error("read error") {}
+};
+
+class EasySNMP {
+    // Cache is the last value taken of a cached var. The versions of the
+    // MIB and the workers share it, so it's changed under mu.
+    struct Cache {
+        mutex mu;
+        long long expires = 0;  // ns, monotonic
+        int type = 0;
+        string enc;  // encoded value
+    };
+
+    // Entry is a registered var with BER encodings made once in add
+    struct Entry {
+        Var *var;
+        int type;
+        int oid_len;
+        string enc;  // oid followed by the value if it's constant
+
+        // the value of a cached var is reused until it expires
+        int max_age_ms = 0;
+        shared_ptr<Cache> cache;
+
+        const Sampler::Job *job = NULL;  // of a sampled var
+        const Metric *metric = NULL;     // used instead of var if set
+
+        bool constant() const {
+            return (int)enc.size() > oid_len;
+        }
+
+        asn1_str_t enc_oid() const {
+            return {(char *)enc.data(), oid_len};
+        }
+
+        asn1_str_t enc_value() const {
+            return {(char *)enc.data() + oid_len, (int)enc.size() - oid_len};
+        }
+    };
+
+    // Mib is one version of everything registered. A published version is
+    // only read, but for the var caches.
+    struct Mib {
+        Trie<Entry> oids;
+        FlatIndex<Entry> flat;  // the copy of oids kept if frozen
+        bool frozen = false;
+
+        map<OID, Subtree *> subtrees;  // by the root
+
+        Mib() = default;
+
+        Mib(const Mib &b) : oids(b.oids), frozen(b.frozen), subtrees(b.subtrees) {}
+
+        void ready() {
+            if (!frozen) {
+                flat.clear();
+                return;
+            }
+
+            vector<pair<string, Entry *>> all;
+            all.reserve(oids.size());
+
+            oids.each([&all](const vector<uint32_t> &path, Entry &e) {
+                OID k(vector<int>(path.begin(), path.end()));
+                all.emplace_back(string(k.bytes().b, k.bytes().len), &e);
+            });
+
+            flat.build(all);
+        }
+    };
+
+    // Shared is what the EasySNMPs serving one MIB have in common
+    struct Shared {
+        Rcu<Mib> mibs;
+        Sampler sampler;
+    };
+
+    // Walk is the state of lookups for ascending ids
+    struct Walk {
+        Entry *e = NULL;   // the last found
+        asn1_oid_t leaf;   // its oid
+        size_t slot = 0;   // in mib->flat
+        bool end = false;  // nothing after the last id
+    };
+
+    int fd = -1;
+
+    shared_ptr<Shared> shared;
+    Mib *mib = NULL;  // pinned while serving a request
+    int slot = -1;
+
+    vector<uint32_t> path;   // of the last oids.next
+    vector<asn1_oid_t> ids;  // of the request varbinds
+    vector<int> order;       // of ids, ascending
+    vector<Walk> walks;      // a GETBULK column each
+
+    // everything allocated while serving one request is from the arena
+    asn1_arena_t arena;
+    vector<char> rbuf;
+    snmp_batch_t batch = {};  // of serve_batch, made on the first call
+    char *sbuf = NULL;
+    int sbuf_len = 0;
+    char *cbuf = NULL;  // to encode cached values
+    int cbuf_len = 0;
+
+    long long now = 0;  // ns, monotonic, taken once per request
+
+   public:
+    struct Stats {
+        long long requests;
+        long long mallocs;  // made by asn1 and snmp while serving
+        long long cache_hits;
+        long long cache_misses;
+
+        // batches[j] counts serve_batch calls taking 2^j to 2^(j+1)-1
+        // requests, the last one those taking more
+        long long batches[8];
+    };
+
+    Stats stats = {};
+
+    // max_msg_size limits GETBULK responses, lower it to avoid IP
+    // fragmentation
+    int max_msg_size = SNMP_MAX_MSG_SIZE;
+
+    bool dump = false;  // requests and responses to stderr
+
+    int batch_size = 32;  // most requests a serve_batch call takes
+
+   private:
+    // finish releases the whole request/response cycle at once
+    void finish(snmp_pdu_t *p, long long mallocs) {
+        snmp_free_pdu(p);
+        stats.requests++;
+
+        release(mallocs);
+    }
+
+    // release drops the arena and the MIB pinned since mallocs was taken
+    void release(long long mallocs) {
+        asn1_arena_reset(&arena);
+
+        if (mib != NULL) {
+            shared->mibs.unlock(slot);
+            mib = NULL;
+        }
+
+        stats.mallocs += asn1_alloc_stats()->mallocs - mallocs;
+    }
+
+    // next yields the next request varbind and its oid decoded into id.
+    // A decoding error is turned into the error response.
+    bool next(snmp_pdu_iter_t *it, snmp_var_ref_t *r, asn1_oid_t *id) {
+        snmp_pdu_t *p = it->pdu;
+
+        int n = snmp_pdu_iter_next(it, r);
+        if (n < 0) {
+            snmp_free_pdu_vars(p);
+            snmp_add_error(p, p->error.code, p->error.message);
+            return false;
+        }
+
+        if (n == 0) {
+            return false;
+        }
+
+        *id = {};
+        asn1_ref_oid(p->arena, r->oid, id);
+
+        return true;
+    }
+
+    // lookup finds the entry at id
+    Entry *lookup(snmp_pdu_t *p, const asn1_oid_t &id) {
+        if (!mib->frozen) {
+            return mib->oids.find(asn1_oid_arcs(&id), id.len);
+        }
+
+        OID k(id, p->arena);
+
+        return mib->flat.find(k.bytes());
+    }
+
+    // lookup_next finds the first entry after id and puts its oid to res.
+    // Lookups for ascending ids share w: an id before the last entry found
+    // gets it again, and the frozen index steps forward from it.
+    Entry *lookup_next(snmp_pdu_t *p, const asn1_oid_t &id, asn1_oid_t *res, Walk *w) {
+        if (w->end) {
+            return NULL;
+        }
+
+        if (w->e != NULL && asn1_cmp_oids(&id, &w->leaf) < 0) {
+            *res = w->leaf;
+            return w->e;
+        }
+
+        Entry *e;
+
+        if (!mib->frozen) {
+            e = mib->oids.next(asn1_oid_arcs(&id), id.len, &path);
+            if (e != NULL) {
+                *res = asn1_arena_crt_oid(p->arena, path.data(), path.size());
+            }
+        } else {
+            OID k(id, p->arena);
+            asn1_str_t found;
+
+            e = mib->flat.next(k.bytes(), &found, &w->slot);
+            if (e != NULL && asn1_key_oid(p->arena, found, res) != 0) {
+                throw logic_error("bad index key");
+            }
+        }
+
+        w->e = e;
+        w->end = e == NULL;
+        if (e != NULL) {
+            w->leaf = *res;
+        }
+
+        return e;
+    }
+
+    // get puts the value at v->oid to v, false if there is nothing there
+    bool get(snmp_pdu_t *p, snmp_var_t *v) {
+        Entry *e = lookup(p, v->oid);
+        if (e != NULL) {
+            set(p, v, *e);
+            return true;
+        }
+
+        const map<OID, Subtree *> &subtrees = mib->subtrees;
+        if (subtrees.empty()) {
+            return false;
+        }
+
+        auto it = subtrees.upper_bound(OID(v->oid, p->arena));
+        if (it == subtrees.begin()) {
+            return false;
+        }
+
+        --it;
+
+        const asn1_oid_t &root = it->first.ref();
+        if (!asn1_oid_has_prefix(&v->oid, &root)) {
+            return false;
+        }
+
+        v->type = it->second->get(root, v->oid, p->arena, &v->value);
+
+        return v->type != 0;
+    }
+
+    // get_next puts the first var after id and its oid to v, leafs and
+    // subtrees are merged in OID order. w walks the leafs, see lookup_next.
+    bool get_next(snmp_pdu_t *p, const asn1_oid_t &id, snmp_var_t *v, Walk *w) {
+        asn1_oid_t leaf;
+
+        Entry *e = lookup_next(p, id, &leaf, w);
+
+        const map<OID, Subtree *> &subtrees = mib->subtrees;
+        if (!subtrees.empty()) {
+            // the subtree id is in, or else the first one after it
+            auto it = subtrees.upper_bound(OID(id, p->arena));
+            if (it != subtrees.begin() && asn1_oid_has_prefix(&id, &prev(it)->first.ref())) {
+                --it;
+            }
+
+            for (; it != subtrees.end(); ++it) {
+                const asn1_oid_t &root = it->first.ref();
+
+                if (e != NULL && asn1_cmp_oids(&leaf, &root) < 0) {
+                    break;
+                }
+
+                asn1_oid_t res;
+                snmp_value_t val = {};
+
+                int tp = it->second->next(root, id, p->arena, &res, &val);
+                if (tp == 0) {
+                    continue;
+                }
+
+                if (e == NULL || asn1_cmp_oids(&res, &leaf) < 0) {
+                    v->oid = res;
+                    v->type = tp;
+                    v->value = val;
+                    return true;
+                }
+
+                break;
+            }
+        }
+
+        if (e == NULL) {
+            return false;
+        }
+
+        v->oid = leaf;
+        set(p, v, *e);
+
+        return true;
+    }
+
+    // overhead is the most the message takes around the varbinds of p
+    static int overhead(const snmp_pdu_t *p) {
+        // message, pdu and varbind list sequences, version, request id,
+        // error status and index
+        return 3 * asn1_header_size(SNMP_MAX_MSG_SIZE) + asn1_int_size(p->version) + asn1_int_size(p->req_id) +
+               2 * asn1_int_size(-1) + asn1_header_size(p->community.len) + p->community.len;
+    }
+
+    static long long monotonic() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+
+    // cached puts the cached value of e into v, taking a new one if it's
+    // expired. All the uses in one request see the same value. The
+    // encoding is copied to the arena as another worker may replace it.
+    void cached(snmp_pdu_t *p, snmp_var_t *v, Entry &e) {
+        Cache &c = *e.cache;
+        lock_guard<mutex> lock(c.mu);
+
+        if (now < c.expires) {
+            stats.cache_hits++;
+        } else {
+            stats.cache_misses++;
+
+            int tp = e.var->type();
+            if (tp == 0) {
+                throw logic_error("bad var");
+            }
+
+            int i = 0;
+            snmp_value_t val = e.var->val(p->arena);
+
+            if (snmp_enc_value(&cbuf, &i, &cbuf_len, tp, &val)) {
+                throw logic_error("can't encode var");
+            }
+
+            c.type = tp;
+            c.enc.assign(cbuf, i);
+            c.expires = now + e.max_age_ms * 1000000LL;
+        }
+
+        char *b = (char *)asn1_alloc(p->arena, c.enc.size());
+        memcpy(b, c.enc.data(), c.enc.size());
+
+        v->type = c.type;
+        v->enc_value = {b, (int)c.enc.size()};
+    }
+
+    // sampled puts the last value of a sampled var into v. The encoding is
+    // copied to the arena as the sample may be replaced before it's sent.
+    void sampled(snmp_pdu_t *p, snmp_var_t *v, Entry &e) {
+        shared_ptr<const Sampler::Sample> s = e.job->get();
+
+        char *b = (char *)asn1_alloc(p->arena, s->enc.size());
+        memcpy(b, s->enc.data(), s->enc.size());
+
+        v->type = s->type;
+        v->enc_value = {b, (int)s->enc.size()};
+    }
+
+    // set puts the value of e into v, the oid is expected to be there already
+    void set(snmp_pdu_t *p, snmp_var_t *v, Entry &e) {
+        v->enc_oid = e.enc_oid();
+
+        if (e.metric != NULL) {
+            v->type = e.metric->type;
+            v->value = e.metric->val();
+            return;
+        }
+
+        if (e.constant()) {
+            v->type = e.type;
+            v->enc_value = e.enc_value();
+            return;
+        }
+
+        if (e.max_age_ms > 0) {
+            cached(p, v, e);
+            return;
+        }
+
+        if (e.job != NULL) {
+            sampled(p, v, e);
+            return;
+        }
+
+        v->type = e.var->type();
+        if (v->type == 0) {
+            throw logic_error("bad var");
+        }
+
+        v->value = e.var->val(p->arena);
+    }
+
+    EasySNMP(shared_ptr<Shared> sh) : shared(sh), rbuf(64 << 10) {
+        if (asn1_arena_init(&arena, 16 << 10)) {
+            throw bad_alloc();
+        }
+    }
+
+   public:
+    EasySNMP() : EasySNMP(make_shared<Shared>()) {}
+
+    // EasySNMP(s) serves the MIB of s with its own socket, buffers and
+    // stats, to be used from another thread. Registering through either
+    // one changes the MIB of both.
+    explicit EasySNMP(EasySNMP &s) : EasySNMP(s.shared) {}
+
+    EasySNMP(const EasySNMP &) = delete;
+    EasySNMP &operator=(const EasySNMP &) = delete;
+
+    ~EasySNMP() {
+        asn1_arena_free(&arena);
+        snmp_batch_free(&batch);
+        asn1_release(NULL, sbuf);
+        asn1_release(NULL, cbuf);
+    }
+
+    // listen binds addr, with reuseport several sockets can be bound to it
+    // and the kernel spreads the requests over them
+    void listen(string addr, bool reuseport = false) {
+        fd = snmp_bind_addr_flags(addr.c_str(), reuseport ? SNMP_BIND_REUSEPORT : 0);
+        if (fd < 0) {
+            throw logic_error("can't bind");
+        }
+    }
+
+    // resp_* stream request varbinds from it and build the response in p
+
+    void resp_get(snmp_pdu_t *p, snmp_pdu_iter_t *it) {
+        snmp_var_ref_t r;
+        asn1_oid_t id;
+
+        while (next(it, &r, &id)) {
+            snmp_add_var(p, id, 0, NULL);
+
+            snmp_var_t *v = &p->vars[p->vars_len - 1];
+
+            if (!get(p, v)) {
+                v->type = SNMP_TP_NO_SUCH_OBJ;
+                //  snmp_add_error(p, SNMP_ERR_NO_SUCH_NAME, "no such variable");
+            }
+        }
+
+        if (p->vars_len == 0) {
+            snmp_add_error(p, 1, "empty request");
+        }
+    }
+
+    // resp_get_next answers all the varbinds. They are looked up in OID
+    // order, so the lookups go forward over the MIB once.
+    void resp_get_next(snmp_pdu_t *p, snmp_pdu_iter_t *it) {
+        snmp_var_ref_t r;
+        asn1_oid_t id;
+
+        ids.clear();
+        while (next(it, &r, &id)) {
+            ids.push_back(id);
+            snmp_add_var(p, id, 0, NULL);
+        }
+
+        if (p->error_status) {
+            return;
+        }
+
+        if (ids.empty()) {
+            snmp_add_error(p, 1, "empty request");
+            return;
+        }
+
+        order.resize(ids.size());
+        for (size_t j = 0; j < order.size(); j++) {
+            order[j] = j;
+        }
+
+        sort(order.begin(), order.end(), [this](int a, int b) { return asn1_cmp_oids(&ids[a], &ids[b]) < 0; });
+
+        Walk w;
+
+        for (int j : order) {
+            snmp_var_t *v = &p->vars[j];
+            if (!get_next(p, ids[j], v, &w)) {
+                v->type = SNMP_TP_END_OF_MIB_VIEW;
+            }
+        }
+    }
+
+    // resp_get_bulk answers the first max_repeaters varbinds (the
+    // non-repeaters) like GETNEXT, then walks the rest together for up to
+    // max_repetitions rows. Rows stop when they would make the message
+    // bigger than max_msg_size, or when all the walks are at the end.
+    // Whatever doesn't fit is cut from the end, down to no varbinds at
+    // all, and the response is still noError (RFC 3416 4.2.3).
+    void resp_get_bulk(snmp_pdu_t *p, snmp_pdu_iter_t *it) {
+        snmp_var_ref_t r;
+        asn1_oid_t id;
+
+        int budget = max_msg_size - overhead(p);
+        int non_repeaters = p->max_repeaters;
+
+        for (int k = 0; k < non_repeaters && next(it, &r, &id); k++) {
+            snmp_add_var(p, id, 0, NULL);
+
+            Walk w;
+
+            snmp_var_t *v = &p->vars[p->vars_len - 1];
+            if (!get_next(p, id, v, &w)) {
+                v->type = SNMP_TP_END_OF_MIB_VIEW;
+            }
+
+            budget -= snmp_var_size(v);
+            if (budget < 0) {
+                p->vars_len--;  // this one and the rest are cut
+                return;
+            }
+        }
+
+        ids.clear();
+        while (next(it, &r, &id)) {
+            ids.push_back(id);
+        }
+
+        if (p->error_status) {
+            return;
+        }
+
+        if (p->vars_len == 0 && ids.empty()) {
+            snmp_add_error(p, 1, "empty request");
+            return;
+        }
+
+        // each column goes forward, so it has its own walk
+        walks.assign(ids.size(), Walk());
+
+        int prev = 0;  // the previous row
+
+        for (int m = 0; m < p->max_repetitions && !ids.empty(); m++) {
+            int row = p->vars_len;
+            int size = 0;
+            bool more = false;
+
+            for (size_t j = 0; j < ids.size(); j++) {
+                asn1_oid_t last = m == 0 ? ids[j] : p->vars[prev + j].oid;  // arcs are in the arena
+                bool ended = m != 0 && p->vars[prev + j].type == SNMP_TP_END_OF_MIB_VIEW;
+
+                snmp_add_var(p, last, 0, NULL);
+
+                snmp_var_t *v = &p->vars[p->vars_len - 1];
+                if (ended || !get_next(p, last, v, &walks[j])) {
+                    v->type = SNMP_TP_END_OF_MIB_VIEW;
+                } else {
+                    more = true;
+                }
+
+                size += snmp_var_size(v);
+            }
+
+            if (size > budget) {
+                p->vars_len = row;  // only whole rows
+                break;
+            }
+
+            budget -= size;
+            prev = row;
+
+            if (!more) {
+                break;
+            }
+        }
+    }
+
+    // respond turns p, received with result r, into the response
+    void respond(snmp_pdu_t *p, snmp_pdu_iter_t *it, int r) {
+        if (r < 0) {
+            if (p->error.code == 0) {
+                perror("recv pdu error, errno:");
+                throw ReadError();
+            } else {
+                cerr << "recv pdu: " << p->error.message << endl;
+            }
+
+            snmp_free_pdu_vars(p);
+            snmp_add_error(p, p->error.code, p->error.message);
+        } else {
+            if (dump) {
+                snmp_dump_pdu("got ", p);
+            }
+
+            switch (p->command) {
+            case SNMP_CMD_GET:
+                resp_get(p, it);
+                break;
+            case SNMP_CMD_GET_NEXT:
+                resp_get_next(p, it);
+                break;
+            case SNMP_CMD_GET_BULK:
+                resp_get_bulk(p, it);
+                break;
+            default:
+                snmp_free_pdu_vars(p);
+                snmp_add_error(p, SNMP_ERR_GENERAL, "unsupported command");
+                break;
+            }
+        }
+
+        p->command = SNMP_CMD_RESPONSE;
+    }
+
+    void serve() {
+        snmp_pdu_t p = {};
+        p.arena = &arena;
+
+        snmp_pdu_iter_t it;
+
+        long long mallocs = asn1_alloc_stats()->mallocs;
+
+        try {
+            int r = snmp_recv_pdu_iter(fd, rbuf.data(), rbuf.size(), &p, &it);
+            now = monotonic();
+            mib = shared->mibs.lock(&slot);
+
+            respond(&p, &it, r);
+
+            r = snmp_send_pdu_buf(fd, &sbuf, &sbuf_len, &p);
+            if (dump) {
+                snmp_dump_pdu("send", &p);
+            }
+
+            if (r < 0) {
+                if (p.error.code == 0) {
+                    perror("send pdu error, errno:");
+                    snmp_dump_pdu(NULL, &p);
+                    throw logic_error("send response");
+                } else {
+                    cerr << "send pdu: " << p.error.message << endl;
+                    snmp_dump_pdu(NULL, &p);
+                }
+            }
+        } catch (...) {
+            finish(&p, mallocs);
+
+            throw;
+        }
+
+        finish(&p, mallocs);
+    }
+
+    // serve_batch answers the requests already there, up to batch_size,
+    // receiving them with one syscall and sending the responses with
+    // another. It waits for one if there are none. The arena and the MIB
+    // version are kept until the responses are sent, all the requests see
+    // the same time. A request failing gets no response, its exception is
+    // thrown once the others are answered. Returns the number of requests,
+    // 0 once the socket is shut down.
+    int serve_batch() {
+        if (batch.cap != batch_size) {
+            snmp_batch_free(&batch);
+
+            if (snmp_batch_init(&batch, batch_size, rbuf.size())) {
+                throw bad_alloc();
+            }
+        }
+
+        long long mallocs = asn1_alloc_stats()->mallocs;
+
+        int n;
+        do {
+            n = snmp_recv_batch(fd, &batch);
+        } while (n < 0 && errno == EINTR);
+
+        if (n < 0) {
+            perror("recv batch error, errno:");
+            throw ReadError();
+        }
+
+        if (n == 0) {
+            return 0;  // shut down
+        }
+
+        exception_ptr failed;
+
+        now = monotonic();
+        mib = shared->mibs.lock(&slot);
+
+        for (int k = 0; k < n; k++) {
+            snmp_pdu_t p = {};
+            p.arena = &arena;
+
+            snmp_pdu_iter_t it;
+
+            try {
+                respond(&p, &it, snmp_batch_iter(&batch, k, &p, &it));
+
+                if (snmp_batch_add_pdu(&batch, &p) < 0) {
+                    cerr << "send pdu: " << p.error.message << endl;
+                    snmp_dump_pdu(NULL, &p);
+                } else if (dump) {
+                    snmp_dump_pdu("send", &p);
+                }
+            } catch (...) {
+                if (!failed) {
+                    failed = current_exception();
+                }
+            }
+
+            snmp_free_pdu(&p);
+            stats.requests++;
+        }
+
+        snmp_send_batch(fd, &batch);
+        if (batch.error.code != 0) {
+            cerr << "send batch: " << batch.error.message << endl;
+        }
+
+        release(mallocs);
+
+        int j = 0;
+        while (j < 7 && n >> (j + 1) != 0) {
+            j++;
+        }
+
+        stats.batches[j]++;
+
+        if (failed) {
+            rethrow_exception(failed);
+        }
+
+        return n;
+    }
+
+    // shutdown makes serve_batch return 0, also the call waiting in
+    // another thread
+    void shutdown() {
+        snmp_shutdown(fd);
+    }
+
+    void close() {
+        if (fd >= 0) {
+            snmp_close(fd);
+            fd = -1;
+        }
+    }
+
+   private:
+    // entry makes the entry of cb at oid. The value of a constant var is
+    // taken and encoded once here and never asked again.
+    static Entry entry(const OID &oid, Var *cb, bool constant) {
+        Entry e;
+        e.var = cb;
+        e.type = cb != NULL ? cb->type() : 0;
+
+        snmp_var_t v = {};
+        if (constant) {
+            v.type = e.type;
+            v.value = cb->val(NULL);
+        }
+
+        char *b = NULL;
+        int i = 0, l = 0;
+
+        int r = asn1_enc_oid(&b, &i, &l, ASN1_OID, &oid.ref());
+        e.oid_len = i;
+
+        if (r == 0 && constant) {
+            r = snmp_enc_value(&b, &i, &l, e.type, &v.value);
+        }
+
+        snmp_free_var_value(&v);
+
+        if (r == 0) {
+            e.enc.assign(b, i);
+        }
+
+        asn1_release(NULL, b);
+
+        if (r) {
+            throw logic_error("can't encode var");
+        }
+
+        return e;
+    }
+
+    void put(const OID &oid, const Entry &e) {
+        Mib *m = shared->mibs.begin();
+        m->oids.put(asn1_oid_arcs(&oid.ref()), oid.ref().len) = e;
+        shared->mibs.commit();
+    }
+
+   public:
+    // The registration methods are safe to call while serving. Each one
+    // publishes a new version of the MIB, the requests in flight finish
+    // with the old one. Once serving has started that copies the whole
+    // MIB (and rebuilds the flat index if frozen), so n changes one by one
+    // cost O(n^2): wrap many of them in begin and commit to publish them
+    // at once. Before the first request changes are made in place.
+
+    void begin() {
+        shared->mibs.begin();
+    }
+
+    void commit() {
+        shared->mibs.commit();
+    }
+
+    // add registers cb at oid. The value of a constant var is taken and
+    // encoded once here and never asked again.
+    void add(const OID &oid, Var *cb, bool constant = false) {
+        put(oid, entry(oid, cb, constant));
+    }
+
+    // add_cached registers cb at oid like add, but a value taken is reused
+    // for max_age_ms before cb is asked again
+    void add_cached(const OID &oid, Var *cb, int max_age_ms) {
+        Entry e = entry(oid, cb, false);
+        e.max_age_ms = max_age_ms;
+        e.cache = make_shared<Cache>();
+
+        put(oid, e);
+    }
+
+    // add_sampled registers cb at oid to be taken every period_ms by the
+    // sampler threads, see start_sampler. Requests read the last value.
+    void add_sampled(const OID &oid, Var *cb, int period_ms) {
+        Entry e = entry(oid, cb, false);
+        e.job = shared->sampler.add(cb, period_ms);
+
+        put(oid, e);
+    }
+
+    // start_sampler runs n threads taking the sampled vars
+    void start_sampler(int n) {
+        shared->sampler.start(n);
+    }
+
+    // add registers the metric m at oid, it's read on every request
+    void add(const OID &oid, const Metric *m) {
+        Entry e = entry(oid, NULL, false);
+        e.type = m->type;
+        e.metric = m;
+
+        put(oid, e);
+    }
+
+    // add delegates everything under root to t, a Table is added at its
+    // entry oid. Subtrees must not overlap.
+    void add(const OID &root, Subtree *t) {
+        Mib *m = shared->mibs.begin();
+        m->subtrees[root] = t;
+        shared->mibs.commit();
+    }
+
+    // synchronize waits for the requests which could have seen the MIB
+    // before the last commit to finish. Must not be called from a var.
+    void synchronize() {
+        shared->mibs.synchronize();
+    }
+
+    // remove unregisters the var or the subtree at oid. Once it returns no
+    // request uses them anymore, so they can be deleted. Within begin and
+    // commit that holds after the commit and a synchronize. Must not be
+    // called from a var.
+    void remove(const OID &oid) {
+        const Sampler::Job *job = NULL;
+
+        Mib *m = shared->mibs.begin();
+
+        Entry *e = m->oids.find(asn1_oid_arcs(&oid.ref()), oid.ref().len);
+        if (e != NULL) {
+            job = e->job;
+            m->oids.erase(asn1_oid_arcs(&oid.ref()), oid.ref().len);
+        }
+
+        m->subtrees.erase(oid);
+        shared->mibs.commit();
+        shared->mibs.synchronize();
+
+        if (job != NULL) {
+            shared->sampler.remove(job);
+        }
+    }
+
+    // freeze makes the MIB keep a flat index of the registered vars, which
+    // is faster to search than the trie. It's rebuilt by every change, so
+    // freeze once the bulk of the vars is added.
+    void freeze() {
+        Mib *m = shared->mibs.begin();
+        m->frozen = true;
+        shared->mibs.commit();
+    }
+};
+
+// Workers serves the MIB of an EasySNMP from several threads. Each one
+// has its own EasySNMP with a SO_REUSEPORT socket on the same address,
+// so the kernel spreads the requests over them, and its own buffers and
+// stats. The vars and subtrees are called from all the threads at once.
+class Workers {
+    vector<unique_ptr<EasySNMP>> all;
+    vector<thread> threads;
+
+    // run serves until the socket is shut down or can't be read
+    void run(EasySNMP *s) {
+        for (;;) {
+            try {
+                if (s->serve_batch() == 0) {
+                    return;
+                }
+            } catch (const ReadError &e) {
+                cerr << "snmp.serve " << e.what() << endl;
+                return;
+            } catch (const exception &e) {
+                cerr << "snmp.serve " << e.what() << endl;
+            }
+        }
+    }
+
+   public:
+    Workers(EasySNMP &s, int n) {
+        for (int k = 0; k < n; k++) {
+            all.emplace_back(new EasySNMP(s));
+        }
+    }
+
+    Workers(const Workers &) = delete;
+    Workers &operator=(const Workers &) = delete;
+
+    ~Workers() {
+        stop();
+    }
+
+    // worker k, its settings can be changed before start
+    EasySNMP &operator[](int k) {
+        return *all[k];
+    }
+
+    int size() const {
+        return all.size();
+    }
+
+    // start binds addr for each worker and runs them, worker k pinned to
+    // cpus[k] if it's there and not negative. Throws if they are running.
+    void start(string addr, const vector<int> &cpus = {}) {
+        if (!threads.empty()) {
+            throw logic_error("workers already started");
+        }
+
+        for (size_t k = 0; k < all.size(); k++) {
+            try {
+                all[k]->listen(addr, true);
+            } catch (...) {
+                while (k-- > 0) {
+                    all[k]->close();
+                }
+
+                throw;
+            }
+        }
+
+        for (size_t k = 0; k < all.size(); k++) {
+            threads.emplace_back(&Workers::run, this, all[k].get());
+
+            if (k < cpus.size() && cpus[k] >= 0) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpus[k], &set);
+
+                if (pthread_setaffinity_np(threads.back().native_handle(), sizeof(set), &set) != 0) {
+                    stop();
+                    throw logic_error("can't pin worker");
+                }
+            }
+        }
+    }
+
+    // stop waits for the requests being served and closes the sockets
+    void stop() {
+        if (threads.empty()) {
+            return;  // not started, or stopped already
+        }
+
+        for (auto &w : all) {
+            w->shutdown();
+        }
+
+        for (thread &t : threads) {
+            t.join();
+        }
+
+        for (auto &w : all) {
+            w->close();
+        }
+
+        threads.clear();
+    }
+
+    // stats sums the stats of the workers, they're only read once stopped
+    EasySNMP::Stats stats() const {
+        EasySNMP::Stats r = {};
+
+        for (auto &w : all) {
+            const EasySNMP::Stats &s = w->stats;
+
+            r.requests += s.requests;
+            r.mallocs += s.mallocs;
+            r.cache_hits += s.cache_hits;
+            r.cache_misses += s.cache_misses;
+
+            for (int j = 0; j < 8; j++) {
+                r.batches[j] += s.batches[j];
+            }
+        }
+
+        return r;
+    }
+};
+
 }  // namespace snmp
@@ -44,12 +44,12 @@ int main(int argc, char *argv[]) {
                 snmp_var_t *v = &p.vars[j];
                 snmp_free_var_value(v);
                 v->type = SNMP_TP_OCT_STR;
-                v->value = asn1_new_str("some value", 0);
+                snmp_arena_set_str(NULL, &v->value, "some value", 10);
             }
 
-            snmp_add_var(&p,                                     //
-                         asn1_crt_oid((int[4]){1, 2, 3, 4}, 4),  //
-                         ASN1_INT, snmp_new_int(5));
+            snmp_add_var(&p,                                          //
+                         asn1_crt_oid((uint32_t[4]){1, 2, 3, 4}, 4),  //
+                         ASN1_INT, &(snmp_value_t){.i = 5});
         }
 
         r = snmp_send_pdu(fd, &p);
@@ -1,14 +1,17 @@
 #define _POSIX_C_SOURCE 200112L
+#define _GNU_SOURCE  // recvmmsg, sendmmsg
 
 #include "snmp.h"
 
 #include <arpa/inet.h>
+#include <errno.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 int snmp_bind(uint32_t addr, int port) {
@@ -36,6 +39,10 @@ error:
 }
 
 int snmp_bind_addr(const char *addr) {
+    return snmp_bind_addr_flags(addr, 0);
+}
+
+int snmp_bind_addr_flags(const char *addr, int flags) {
     struct addrinfo hints;
     struct addrinfo *result, *rp;
     int sfd, s;
@@ -63,6 +70,12 @@ int snmp_bind_addr(const char *addr) {
         if (sfd == -1)
             continue;
 
+        int on = 1;
+        if (flags & SNMP_BIND_REUSEPORT && setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) {
+            close(sfd);
+            continue;
+        }
+
         int r = bind(sfd, rp->ai_addr, rp->ai_addrlen);
         if (r == 0) {
             goto ok;
@@ -88,49 +101,343 @@ int snmp_close(int fd) {
     return close(fd);
 }
 
+// snmp_shutdown stops receiving on fd, waking up the threads waiting for
+// a datagram. The socket is unconnected, so ENOTCONN is expected.
+int snmp_shutdown(int fd) {
+    int r = shutdown(fd, SHUT_RD);
+    if (r < 0 && errno == ENOTCONN) {
+        return 0;
+    }
+
+    return r;
+}
+
+// Values are handled by their kind, what the type keeps in snmp_value_t.
+// Each kind has its functions in _kinds, picked by _kind_of[type].
+
+enum {
+    _KIND_NONE,  // not a known type
+    _KIND_NULL,
+    _KIND_INT,
+    _KIND_LONG,
+    _KIND_UINT32,  // in i
+    _KIND_UINT64,  // in l
+    _KIND_STR,
+    _KIND_OID,
+};
+
+static const unsigned char _kind_of[256] = {
+    [SNMP_TP_BOOL] = _KIND_INT,
+    [SNMP_TP_INT] = _KIND_INT,
+    [SNMP_TP_COUNTER] = _KIND_UINT32,
+    [SNMP_TP_GAUGE] = _KIND_UINT32,
+
+    [SNMP_TP_INT64] = _KIND_LONG,
+    [SNMP_TP_COUNTER64] = _KIND_UINT64,
+    [SNMP_TP_UINT64] = _KIND_UINT64,
+    [SNMP_TP_TIMETICKS] = _KIND_UINT64,
+
+    [SNMP_TP_BIT_STR] = _KIND_STR,
+    [SNMP_TP_OCT_STR] = _KIND_STR,
+    [SNMP_TP_IP_ADDR] = _KIND_STR,
+
+    [SNMP_TP_OID] = _KIND_OID,
+
+    [SNMP_TP_NULL] = _KIND_NULL,
+    [SNMP_TP_NO_SUCH_OBJ] = _KIND_NULL,
+    [SNMP_TP_NO_SUCH_INSTANCE] = _KIND_NULL,
+    [SNMP_TP_END_OF_MIB_VIEW] = _KIND_NULL,
+};
+
+typedef struct {
+    int (*enc)(char **b, int *i, int *l, int tp, const snmp_value_t *v);
+    int (*renc)(asn1_rbuf_t *w, int tp, const snmp_value_t *v);
+    int (*size)(const snmp_value_t *v);  // encoded, tag and length included
+    int (*dec)(asn1_arena_t *a, const char *b, int *i, int l, snmp_value_t *v);
+    void (*free)(snmp_value_t *v);  // heap storage
+    void (*dump)(int tp, const snmp_value_t *v);
+} _kind_t;
+
+static int _enc_null(char **b, int *i, int *l, int tp, const snmp_value_t *v) {
+    return asn1_enc_null(b, i, l, tp);
+}
+
+static int _renc_null(asn1_rbuf_t *w, int tp, const snmp_value_t *v) {
+    return asn1_renc_null(w, tp);
+}
+
+static int _size_null(const snmp_value_t *v) {
+    return 2;
+}
+
+static int _dec_null(asn1_arena_t *a, const char *b, int *i, int l, snmp_value_t *v) {
+    return asn1_dec_string(b, i, l, NULL);
+}
+
+static void _dump_null(int tp, const snmp_value_t *v) {
+    fprintf(stderr, "null [%x]", tp);
+}
+
+static int _enc_int(char **b, int *i, int *l, int tp, const snmp_value_t *v) {
+    return asn1_enc_int(b, i, l, tp, v->i);
+}
+
+static int _renc_int(asn1_rbuf_t *w, int tp, const snmp_value_t *v) {
+    return asn1_renc_int(w, tp, v->i);
+}
+
+static int _size_int(const snmp_value_t *v) {
+    return asn1_int_size(v->i);
+}
+
+static int _dec_int(asn1_arena_t *a, const char *b, int *i, int l, snmp_value_t *v) {
+    return asn1_dec_int(b, i, l, &v->i);
+}
+
+static void _dump_int(int tp, const snmp_value_t *v) {
+    fprintf(stderr, "%d", v->i);
+}
+
+static int _enc_long(char **b, int *i, int *l, int tp, const snmp_value_t *v) {
+    return asn1_enc_long(b, i, l, tp, v->l);
+}
+
+static int _renc_long(asn1_rbuf_t *w, int tp, const snmp_value_t *v) {
+    return asn1_renc_long(w, tp, v->l);
+}
+
+static int _size_long(const snmp_value_t *v) {
+    return asn1_long_size(v->l);
+}
+
+static int _dec_long(asn1_arena_t *a, const char *b, int *i, int l, snmp_value_t *v) {
+    return asn1_dec_long(b, i, l, &v->l);
+}
+
+static void _dump_long(int tp, const snmp_value_t *v) {
+    fprintf(stderr, "%lld", v->l);
+}
+
+static int _enc_uint32(char **b, int *i, int *l, int tp, const snmp_value_t *v) {
+    return asn1_enc_uint(b, i, l, tp, (uint32_t)v->i);
+}
+
+static int _renc_uint32(asn1_rbuf_t *w, int tp, const snmp_value_t *v) {
+    return asn1_renc_uint(w, tp, (uint32_t)v->i);
+}
+
+static int _size_uint32(const snmp_value_t *v) {
+    return asn1_uint_size((uint32_t)v->i);
+}
+
+static int _dec_uint32(asn1_arena_t *a, const char *b, int *i, int l, snmp_value_t *v) {
+    unsigned long long u;
+
+    int r = asn1_dec_uint(b, i, l, &u);
+    v->i = (int)(uint32_t)u;
+
+    return r;
+}
+
+static void _dump_uint32(int tp, const snmp_value_t *v) {
+    fprintf(stderr, "%u", (uint32_t)v->i);
+}
+
+static int _enc_uint64(char **b, int *i, int *l, int tp, const snmp_value_t *v) {
+    return asn1_enc_uint(b, i, l, tp, (unsigned long long)v->l);
+}
+
+static int _renc_uint64(asn1_rbuf_t *w, int tp, const snmp_value_t *v) {
+    return asn1_renc_uint(w, tp, (unsigned long long)v->l);
+}
+
+static int _size_uint64(const snmp_value_t *v) {
+    return asn1_uint_size((unsigned long long)v->l);
+}
+
+static int _dec_uint64(asn1_arena_t *a, const char *b, int *i, int l, snmp_value_t *v) {
+    unsigned long long u;
+
+    int r = asn1_dec_uint(b, i, l, &u);
+    v->l = (long long)u;
+
+    return r;
+}
+
+static void _dump_uint64(int tp, const snmp_value_t *v) {
+    fprintf(stderr, "%llu", (unsigned long long)v->l);
+}
+
+static int _enc_str(char **b, int *i, int *l, int tp, const snmp_value_t *v) {
+    return asn1_enc_string(b, i, l, tp, snmp_value_str(v));
+}
+
+static int _renc_str(asn1_rbuf_t *w, int tp, const snmp_value_t *v) {
+    return asn1_renc_string(w, tp, snmp_value_str(v));
+}
+
+static int _size_str(const snmp_value_t *v) {
+    return asn1_header_size(v->s.len) + v->s.len;
+}
+
+static int _dec_str(asn1_arena_t *a, const char *b, int *i, int l, snmp_value_t *v) {
+    asn1_str_t r;
+
+    int n = asn1_dec_ref(b, i, l, &r);
+    if (n < 0) {
+        return -1;
+    }
+
+    return snmp_arena_set_str(a, v, r.b, r.len);
+}
+
+static void _free_str(snmp_value_t *v) {
+    if (v->s.len > SNMP_STR_INLINE) {
+        asn1_release(NULL, v->s.ext);
+    }
+}
+
+static void _dump_str(int tp, const snmp_value_t *v) {
+    asn1_str_t str = snmp_value_str(v);
+
+    if (tp != SNMP_TP_IP_ADDR) {
+        fprintf(stderr, "%.*s", str.len, str.b);
+        return;
+    }
+
+    for (int j = 0; j < str.len; j++) {
+        if (j != 0) {
+            fprintf(stderr, ".");
+        }
+        fprintf(stderr, "%d", (unsigned char)str.b[j]);
+    }
+}
+
+static int _enc_oid(char **b, int *i, int *l, int tp, const snmp_value_t *v) {
+    return asn1_enc_oid(b, i, l, tp, v->oid);
+}
+
+static int _renc_oid(asn1_rbuf_t *w, int tp, const snmp_value_t *v) {
+    return asn1_renc_oid(w, tp, v->oid);
+}
+
+static int _size_oid(const snmp_value_t *v) {
+    return asn1_oid_size(v->oid);
+}
+
+static int _dec_oid(asn1_arena_t *a, const char *b, int *i, int l, snmp_value_t *v) {
+    v->oid = asn1_alloc(a, sizeof(asn1_oid_t));
+    if (v->oid == NULL) {
+        return -1;
+    }
+
+    *v->oid = (asn1_oid_t){0};
+
+    return asn1_arena_dec_oid(a, b, i, l, v->oid);
+}
+
+static void _free_oid(snmp_value_t *v) {
+    if (v->oid) {
+        asn1_free_oid(v->oid);
+        asn1_release(NULL, v->oid);
+    }
+}
+
+static void _dump_oid(int tp, const snmp_value_t *v) {
+    asn1_dump_oid(v->oid);
+}
+
+static const _kind_t _kinds[] = {
+    [_KIND_NULL] = {_enc_null, _renc_null, _size_null, _dec_null, NULL, _dump_null},
+    [_KIND_INT] = {_enc_int, _renc_int, _size_int, _dec_int, NULL, _dump_int},
+    [_KIND_LONG] = {_enc_long, _renc_long, _size_long, _dec_long, NULL, _dump_long},
+    [_KIND_UINT32] = {_enc_uint32, _renc_uint32, _size_uint32, _dec_uint32, NULL, _dump_uint32},
+    [_KIND_UINT64] = {_enc_uint64, _renc_uint64, _size_uint64, _dec_uint64, NULL, _dump_uint64},
+    [_KIND_STR] = {_enc_str, _renc_str, _size_str, _dec_str, _free_str, _dump_str},
+    [_KIND_OID] = {_enc_oid, _renc_oid, _size_oid, _dec_oid, _free_oid, _dump_oid},
+};
+
+static const _kind_t *_kind(int tp) {
+    if (tp < 0 || tp > 0xff) {
+        return &_kinds[_KIND_NONE];
+    }
+
+    return &_kinds[_kind_of[tp]];
+}
+
+// _dec_kind is _kind for decoded values, the ones of types not known are
+// kept as strings
+static const _kind_t *_dec_kind(int tp) {
+    const _kind_t *k = _kind(tp);
+
+    return k->dec != NULL ? k : &_kinds[_KIND_STR];
+}
+
+int snmp_arena_set_str(asn1_arena_t *a, snmp_value_t *v, const char *s, int len) {
+    v->s.len = len;
+
+    if (len <= SNMP_STR_INLINE) {
+        if (len > 0) {
+            memcpy(v->s.in, s, len);
+        }
+        return 0;
+    }
+
+    v->s.ext = asn1_alloc(a, len);
+    if (v->s.ext == NULL) {
+        v->s.len = 0;
+        return -1;
+    }
+
+    memcpy(v->s.ext, s, len);
+
+    return 0;
+}
+
+int snmp_arena_set_oid(asn1_arena_t *a, snmp_value_t *v, const uint32_t *arcs, int len) {
+    v->oid = asn1_alloc(a, sizeof(asn1_oid_t));
+    if (v->oid == NULL) {
+        return -1;
+    }
+
+    *v->oid = asn1_arena_crt_oid(a, arcs, len);
+
+    return 0;
+}
+
 void snmp_free_var_value(snmp_var_t *v) {
-    switch (v->type) {
-    case SNMP_TP_BOOL:
-    case SNMP_TP_INT:
-    case SNMP_TP_COUNTER:
-    case SNMP_TP_GAUGE:
-    case SNMP_TP_COUNTER64:
-    case SNMP_TP_INT64:
-    case SNMP_TP_UINT64:
-    case SNMP_TP_TIMETICKS:
-        free(v->value);
-        break;
-    case SNMP_TP_BIT_STR:
-    case SNMP_TP_OCT_STR:
-    case SNMP_TP_IP_ADDR:
-    default:
-        asn1_free_str((asn1_str_t *)v->value);
-        free(v->value);
-        break;
-    case SNMP_TP_OID:
-        asn1_free_oid((asn1_oid_t *)v->value);
-        free(v->value);
-        break;
-    case 0:
-    case SNMP_TP_NULL:
-    case SNMP_TP_NO_SUCH_OBJ:
-    case SNMP_TP_NO_SUCH_INSTANCE:
-    case SNMP_TP_END_OF_MIB_VIEW:
-        break;
+    v->enc_value = (asn1_str_t){0};
+
+    const _kind_t *k = _dec_kind(v->type);
+    if (k->free) {
+        k->free(&v->value);
     }
 
     v->type = 0;
-    v->value = NULL;
+    v->value = (snmp_value_t){0};
 }
 
 void snmp_free_var(snmp_var_t *v) {
     asn1_free_oid(&v->oid);
+    v->enc_oid = (asn1_str_t){0};
 
     snmp_free_var_value(v);
 }
 
+// snmp_pdu_free_var_value is snmp_free_var_value for a var of the pdu
+void snmp_pdu_free_var_value(snmp_pdu_t *p, snmp_var_t *v) {
+    if (p->arena == NULL) {
+        snmp_free_var_value(v);
+        return;
+    }
+
+    v->type = 0;
+    v->value = (snmp_value_t){0};
+    v->enc_value = (asn1_str_t){0};
+}
+
 void snmp_free_pdu_vars(snmp_pdu_t *p) {
-    for (int i = 0; i < p->vars_len; i++) {
+    for (int i = 0; p->arena == NULL && i < p->vars_len; i++) {
         snmp_free_var(&p->vars[i]);
     }
 
@@ -138,15 +445,25 @@ void snmp_free_pdu_vars(snmp_pdu_t *p) {
     p->vars_cap = 0;
 
     if (p->vars) {
-        free(p->vars);
+        asn1_release(p->arena, p->vars);
         p->vars = NULL;
     }
 }
 
+// snmp_free_pdu with the arena set is O(1), the arena is reset by its owner.
 void snmp_free_pdu(snmp_pdu_t *p) {
-    asn1_free_str(&p->community);
+    if ((p->flags & SNMP_PDU_REF) || p->arena) {
+        p->community = (asn1_str_t){0};
+    } else {
+        asn1_free_str(&p->community);
+    }
 
     snmp_free_pdu_vars(p);
+
+    p->flags &= ~SNMP_PDU_REF;
+    p->refs = NULL;
+    p->refs_len = 0;
+    p->refs_cap = 0;
 }
 
 static void _hex_dump(const char *b, int pos, int l) {
@@ -172,6 +489,8 @@ static void _hex_dump(const char *b, int pos, int l) {
 
 static int _append_var(snmp_pdu_t *p, snmp_var_t v) {
     if (p->vars_len == p->vars_cap) {
+        int old = p->vars_cap;
+
         if (p->vars_cap == 0) {
             p->vars_cap = 4;
         } else if (p->vars_cap < 100) {
@@ -180,7 +499,7 @@ static int _append_var(snmp_pdu_t *p, snmp_var_t v) {
             p->vars_cap += p->vars_cap / 4;
         }
 
-        p->vars = realloc(p->vars, p->vars_cap * sizeof(snmp_var_t));
+        p->vars = asn1_realloc(p->arena, p->vars, old * sizeof(snmp_var_t), p->vars_cap * sizeof(snmp_var_t));
         if (p->vars == NULL) {
             return -1;
         }
@@ -208,16 +527,13 @@ int snmp_add_error(snmp_pdu_t *p, int code, const char *msg) {
     // v.oid.id = malloc();
 
     v.type = ASN1_OCT_STR;
-
-    asn1_str_t *str = malloc(sizeof(asn1_str_t));
-    str->len = strlen(msg);
-    str->b = malloc(str->len + 1);  // +1 for null byte
-    memcpy(str->b, msg, str->len + 1);
-    v.value = str;
+    snmp_arena_set_str(p->arena, &v.value, msg, strlen(msg));
 
     int r = _append_var(p, v);
     if (r < 0) {
-        snmp_free_var(&v);
+        if (p->arena == NULL) {
+            snmp_free_var(&v);
+        }
         return -1;
     }
 
@@ -235,65 +551,39 @@ int snmp_set_error_index(snmp_pdu_t *p, int code, int index) {
     return 0;
 }
 
-int snmp_add_var(snmp_pdu_t *p, asn1_oid_t oid, int tp, void *val) {
+// snmp_add_var takes oid and the value, val may be NULL for none
+int snmp_add_var(snmp_pdu_t *p, asn1_oid_t oid, int tp, const snmp_value_t *val) {
     snmp_var_t v = {
         .oid = oid,
         .type = tp,
-        .value = val,
     };
 
+    if (val) {
+        v.value = *val;
+    }
+
     return _append_var(p, v);
 }
 
-static int _dec_var(const char *b, int *i, int l, int tp, void *v_) {
-    snmp_var_t *v = (snmp_var_t *)v_;
+static int _dec_var(const char *b, int *i, int l, int tp, void *p_) {
+    snmp_pdu_t *p = (snmp_pdu_t *)p_;
+    snmp_var_t *v = &p->vars[p->vars_len - 1];
+    asn1_arena_t *a = p->arena;
 
     if (b[(*i)++] != ASN1_OID) {
         asn1_set_error(&v->error, *i, "expected oid");
         return -1;
     }
 
-    int r = asn1_dec_oid(b, i, l, &v->oid);
+    int r = asn1_arena_dec_oid(a, b, i, l, &v->oid);
     if (r) {
         asn1_set_error(&v->error, *i, "bad oid");
         return -1;
     }
 
-    v->type = b[(*i)++];
-
-    switch (v->type) {
-    case SNMP_TP_BOOL:
-    case SNMP_TP_INT:
-    case SNMP_TP_COUNTER:
-    case SNMP_TP_GAUGE:
-        v->value = malloc(sizeof(int));
-        r = asn1_dec_int(b, i, l, (int *)v->value);
-        break;
-    case SNMP_TP_COUNTER64:
-    case SNMP_TP_INT64:
-    case SNMP_TP_UINT64:
-    case SNMP_TP_TIMETICKS:
-        v->value = malloc(sizeof(long long));
-        r = asn1_dec_long(b, i, l, (long long *)v->value);
-        break;
-    case SNMP_TP_BIT_STR:
-    case SNMP_TP_OCT_STR:
-    case SNMP_TP_IP_ADDR:
-    default:
-        v->value = calloc(1, sizeof(asn1_str_t));
-        r = asn1_dec_string(b, i, l, (asn1_str_t *)v->value);
-        break;
-    case SNMP_TP_OID:
-        v->value = calloc(1, sizeof(asn1_oid_t));
-        r = asn1_dec_oid(b, i, l, (asn1_oid_t *)v->value);
-        break;
-    case SNMP_TP_NULL:
-    case SNMP_TP_NO_SUCH_OBJ:
-    case SNMP_TP_NO_SUCH_INSTANCE:
-    case SNMP_TP_END_OF_MIB_VIEW:
-        r = asn1_dec_string(b, i, l, NULL);
-        break;
-    }
+    v->type = (unsigned char)b[(*i)++];
+
+    r = _dec_kind(v->type)->dec(a, b, i, l, &v->value);
     if (r) {
         asn1_set_error(&v->error, *i, "bad var value");
         return -1;
@@ -302,24 +592,68 @@ static int _dec_var(const char *b, int *i, int l, int tp, void *v_) {
     return 0;
 }
 
+static int _dec_var_ref(const char *b, int *i, int l, int tp, void *it_) {
+    snmp_pdu_iter_t *it = (snmp_pdu_iter_t *)it_;
+    snmp_pdu_t *p = it->pdu;
+    snmp_var_ref_t *v = it->v;
+
+    if (*i >= l || b[(*i)++] != ASN1_OID) {
+        asn1_set_error(&p->error, *i, "expected oid");
+        return -1;
+    }
+
+    int r = asn1_dec_ref(b, i, l, &v->oid);
+    if (r) {
+        asn1_set_error(&p->error, *i, "bad oid");
+        return -1;
+    }
+
+    if (*i >= l) {
+        asn1_set_error(&p->error, *i, "expected var value");
+        return -1;
+    }
+
+    v->type = (int)b[(*i)++] & 0xff;
+
+    r = asn1_dec_ref(b, i, l, &v->value);
+    if (r) {
+        asn1_set_error(&p->error, *i, "bad var value");
+        return -1;
+    }
+
+    if (*i != l) {
+        asn1_set_error(&p->error, *i, "unused data at the end of var");
+        return -1;
+    }
+
+    return 0;
+}
+
 static int _dec_pdu3(const char *b, int *i, int l, int tp, void *p_) {
     snmp_pdu_t *p = (snmp_pdu_t *)p_;
 
+    // varbinds are left for the iterator
+    if (p->iter) {
+        p->iter->i = *i;
+        p->iter->end = l;
+
+        *i = l;
+
+        return 0;
+    }
+
     snmp_free_pdu_vars(p);
 
     while (*i < l) {
-        snmp_var_t v = {0};
-        int r = asn1_dec_sequence(b, i, l, _dec_var, &v);
-        if (r < 0) {
-            p->error = v.error;
-            snmp_free_var(&v);
+        int r = _append_var(p, (snmp_var_t){0});
+        if (r) {
+            asn1_set_error(&p->error, *i, "alloc vars array");
             return -1;
         }
 
-        r = _append_var(p, v);
-        if (r) {
-            asn1_set_error(&p->error, *i, "alloc vars array");
-            snmp_free_var(&v);
+        r = asn1_dec_sequence(b, i, l, _dec_var, p);
+        if (r < 0) {
+            p->error = p->vars[p->vars_len - 1].error;
             return -1;
         }
     }
@@ -432,7 +766,11 @@ static int _dec_pdu(const char *b, int *i, int l, int tp, void *p_) {
         return -1;
     }
 
-    r = asn1_dec_string(b, i, l, &p->community);
+    if (p->flags & SNMP_PDU_REF) {
+        r = asn1_dec_ref(b, i, l, &p->community);
+    } else {
+        r = asn1_arena_dec_string(p->arena, b, i, l, &p->community);
+    }
     if (r < 0) {
         asn1_set_error(&p->error, *i, "bad community");
         return -1;
@@ -470,48 +808,132 @@ int snmp_dec_pdu(const char *buf, int buf_len, snmp_pdu_t *p) {
     return 0;
 }
 
+// snmp_dec_pdu_ref decodes without copying: community and refs are views
+// into buf and stay valid as long as buf does. refs is caller storage.
+int snmp_dec_pdu_ref(const char *buf, int buf_len, snmp_pdu_t *p, snmp_var_ref_t *refs, int refs_cap) {
+    snmp_pdu_iter_t it;
+
+    p->refs = refs;
+    p->refs_len = 0;
+    p->refs_cap = refs_cap;
+
+    int r = snmp_pdu_iter_init(&it, buf, buf_len, p);
+    if (r < 0) {
+        return r;
+    }
+
+    while (it.i < it.end) {
+        if (p->refs_len == p->refs_cap) {
+            asn1_set_error(&p->error, it.i, "too many vars");
+            return -1;
+        }
+
+        r = snmp_pdu_iter_next(&it, &refs[p->refs_len]);
+        if (r < 0) {
+            return r;
+        }
+
+        p->refs_len++;
+    }
+
+    return 0;
+}
+
+// snmp_pdu_iter_init decodes and checks everything but varbinds, which are
+// decoded by snmp_pdu_iter_next. community points into buf.
+int snmp_pdu_iter_init(snmp_pdu_iter_t *it, const char *buf, int buf_len, snmp_pdu_t *p) {
+    *it = (snmp_pdu_iter_t){
+        .pdu = p,
+        .b = buf,
+    };
+
+    p->flags |= SNMP_PDU_REF;
+    p->iter = it;
+
+    int r = snmp_dec_pdu(buf, buf_len, p);
+
+    p->iter = NULL;
+
+    if (r < 0) {
+        it->i = it->end;
+    }
+
+    return r;
+}
+
+int snmp_pdu_iter_next(snmp_pdu_iter_t *it, snmp_var_ref_t *v) {
+    if (it->i >= it->end) {
+        return 0;
+    }
+
+    it->v = v;
+
+    int r = asn1_dec_sequence(it->b, &it->i, it->end, _dec_var_ref, it);
+
+    it->v = NULL;
+
+    if (r < 0) {
+        asn1_set_error(&it->pdu->error, it->i, "var seq");
+        it->i = it->end;
+        return -1;
+    }
+
+    return 1;
+}
+
+int snmp_enc_value(char **b, int *i, int *l, int tp, const snmp_value_t *val) {
+    const _kind_t *k = _kind(tp);
+    if (k->enc == NULL) {
+        return -1;
+    }
+
+    return k->enc(b, i, l, tp, val);
+}
+
+static int _value_size(int tp, const snmp_value_t *val) {
+    const _kind_t *k = _kind(tp);
+    if (k->size == NULL) {
+        return -1;
+    }
+
+    return k->size(val);
+}
+
+int snmp_var_size(const snmp_var_t *v) {
+    int oid = v->enc_oid.b ? v->enc_oid.len : asn1_oid_size(&v->oid);
+    int val = v->enc_value.b ? v->enc_value.len : _value_size(v->type, &v->value);
+
+    if (val < 0) {
+        return -1;
+    }
+
+    return asn1_header_size(oid + val) + oid + val;
+}
+
 static int _enc_var(char **b, int *i, int *l, void *v_) {
     snmp_var_t *v = (snmp_var_t *)v_;
 
-    int r = asn1_enc_oid(b, i, l, ASN1_OID, v->oid);
+    int r;
+    if (v->enc_oid.b) {
+        r = asn1_enc_raw(b, i, l, v->enc_oid);
+    } else {
+        r = asn1_enc_oid(b, i, l, ASN1_OID, &v->oid);
+    }
     if (r) {
         asn1_set_error(&v->error, *i, "encode var oid");
         return -1;
     }
 
-    switch (v->type) {
-    case 0:
-    default:
+    if (v->type == 0) {
         asn1_set_error(&v->error, *i, "undefined var type");
         return -1;
-    case SNMP_TP_BOOL:
-    case SNMP_TP_INT:
-    case SNMP_TP_COUNTER:
-    case SNMP_TP_GAUGE:
-        r = asn1_enc_int(b, i, l, v->type, *(int *)v->value);
-        break;
-    case SNMP_TP_COUNTER64:
-    case SNMP_TP_INT64:
-    case SNMP_TP_UINT64:
-    case SNMP_TP_TIMETICKS:
-        r = asn1_enc_long(b, i, l, v->type, *(long long *)v->value);
-        break;
-    case SNMP_TP_BIT_STR:
-    case SNMP_TP_OCT_STR:
-    case SNMP_TP_IP_ADDR:
-        r = asn1_enc_string(b, i, l, v->type, *(asn1_str_t *)v->value);
-        break;
-    case SNMP_TP_OID:
-        r = asn1_enc_oid(b, i, l, v->type, *(asn1_oid_t *)v->value);
-        break;
-    case SNMP_TP_NULL:
-    case SNMP_TP_NO_SUCH_OBJ:
-    case SNMP_TP_NO_SUCH_INSTANCE:
-    case SNMP_TP_END_OF_MIB_VIEW:
-        r = asn1_enc_null(b, i, l, v->type);
-        break;
     }
 
+    if (v->enc_value.b) {
+        r = asn1_enc_raw(b, i, l, v->enc_value);
+    } else {
+        r = snmp_enc_value(b, i, l, v->type, &v->value);
+    }
     if (r) {
         asn1_set_error(&v->error, *i, "encode var value");
         return -1;
@@ -615,79 +1037,467 @@ int snmp_enc_pdu(char **buf, int *i, int *buf_len, snmp_pdu_t *p) {
     return 0;
 }
 
-int snmp_recv_pdu(int fd, snmp_pdu_t *p) {
-    int ret = -1;
+static int _renc_value(asn1_rbuf_t *w, int tp, const snmp_value_t *val) {
+    const _kind_t *k = _kind(tp);
+    if (k->renc == NULL) {
+        return -1;
+    }
 
-    p->error = (asn1_error_t){0};
+    return k->renc(w, tp, val);
+}
 
-    int buf_len = 20 * (1 << 10);
-    char *buf = malloc(buf_len);
-    if (!buf) {
-        asn1_set_error(&p->error, -1, "alloc read buffer");
-        goto error;
+static int _renc_var(asn1_rbuf_t *w, snmp_var_t *v) {
+    int end = w->i;
+    int r;
+
+    if (v->type == 0) {
+        asn1_set_error(&v->error, w->i, "undefined var type");
+        return -1;
+    }
+
+    if (v->enc_value.b) {
+        r = asn1_renc_raw(w, v->enc_value);
+    } else {
+        r = _renc_value(w, v->type, &v->value);
+    }
+    if (r) {
+        asn1_set_error(&v->error, w->i, "encode var value");
+        return -1;
+    }
+
+    if (v->enc_oid.b) {
+        r = asn1_renc_raw(w, v->enc_oid);
+    } else {
+        r = asn1_renc_oid(w, ASN1_OID, &v->oid);
+    }
+    if (r) {
+        asn1_set_error(&v->error, w->i, "encode var oid");
+        return -1;
+    }
+
+    r = asn1_renc_sequence(w, ASN1_CONSTRUCTOR | ASN1_SEQ, end);
+    if (r) {
+        asn1_set_error(&v->error, w->i, "encode var sequence");
+        return -1;
+    }
+
+    return 0;
+}
+
+// snmp_renc_pdu encodes p back to front into the end of w.
+// Output is the same as of snmp_enc_pdu without moving any data around.
+// Each of the varbind list, pdu and message is the last in its parent
+// so they all end at the same point.
+int snmp_renc_pdu(asn1_rbuf_t *w, snmp_pdu_t *p) {
+    int end = w->i;
+
+    for (int j = p->vars_len - 1; j >= 0; j--) {
+        p->vars[j].error = (asn1_error_t){0};
+
+        int r = _renc_var(w, &p->vars[j]);
+        if (r) {
+            p->error = p->vars[j].error;
+            asn1_set_error(&p->error, w->i, "encode var sequence");
+            return -1;
+        }
+    }
+
+    int r = asn1_renc_sequence(w, ASN1_CONSTRUCTOR | ASN1_SEQ, end);
+    if (r) {
+        asn1_set_error(&p->error, w->i, "pdu2 seq");
+        return -1;
+    }
+
+    if (p->command == SNMP_CMD_GET_BULK) {
+        r = asn1_renc_int(w, ASN1_INT, p->max_repetitions);
+        if (r) {
+            asn1_set_error(&p->error, w->i, "encode max repetitions");
+            return -1;
+        }
+
+        r = asn1_renc_int(w, ASN1_INT, p->max_repeaters);
+        if (r) {
+            asn1_set_error(&p->error, w->i, "encode max repeaters");
+            return -1;
+        }
+    } else {
+        r = asn1_renc_int(w, ASN1_INT, p->error_index);
+        if (r) {
+            asn1_set_error(&p->error, w->i, "encode error index");
+            return -1;
+        }
+
+        r = asn1_renc_int(w, ASN1_INT, p->error_status);
+        if (r) {
+            asn1_set_error(&p->error, w->i, "encode error status");
+            return -1;
+        }
+    }
+
+    r = asn1_renc_int(w, ASN1_INT, p->req_id);
+    if (r) {
+        asn1_set_error(&p->error, w->i, "encode req id");
+        return -1;
+    }
+
+    r = asn1_renc_sequence(w, p->command, end);
+    if (r) {
+        asn1_set_error(&p->error, w->i, "pdu1 seq");
+        return -1;
+    }
+
+    r = asn1_renc_string(w, ASN1_OCT_STR, p->community);
+    if (r) {
+        asn1_set_error(&p->error, w->i, "encode community");
+        return -1;
+    }
+
+    r = asn1_renc_int(w, ASN1_INT, p->version);
+    if (r) {
+        asn1_set_error(&p->error, w->i, "encode version");
+        return -1;
+    }
+
+    r = asn1_renc_sequence(w, ASN1_CONSTRUCTOR | ASN1_SEQ, end);
+    if (r) {
+        asn1_set_error(&p->error, w->i, "pdu seq");
+        return -1;
     }
 
+    return 0;
+}
+
+static ssize_t _recv(int fd, char *buf, int buf_len, snmp_pdu_t *p) {
+    p->error = (asn1_error_t){0};
+
     p->addr_len = sizeof(p->addr);
     memset(&p->addr, 0, p->addr_len);
 
     ssize_t n = recvfrom(fd, (void *)buf, buf_len, 0, (struct sockaddr *)&p->addr, &p->addr_len);
     if (n < 0) {
         asn1_set_error(&p->error, -1, "recvfrom");
-        ret = n;
-        goto error;
+    }
+
+    return n;
+}
+
+int snmp_recv_pdu(int fd, snmp_pdu_t *p) {
+    int buf_len = 20 * (1 << 10);
+    char *buf = asn1_alloc(p->arena, buf_len);
+    if (!buf) {
+        p->error = (asn1_error_t){0};
+        asn1_set_error(&p->error, -1, "alloc read buffer");
+        return -1;
+    }
+
+    int ret = snmp_recv_pdu_buf(fd, buf, buf_len, p);
+
+    asn1_release(p->arena, buf);
+
+    return ret;
+}
+
+int snmp_recv_pdu_buf(int fd, char *buf, int buf_len, snmp_pdu_t *p) {
+    ssize_t n = _recv(fd, buf, buf_len, p);
+    if (n < 0) {
+        return n;
     }
 
     int r = snmp_dec_pdu(buf, n, p);
     if (r < 0) {
-        goto error;
+        return r;
     }
 
-    ret = n;
+    return n;
+}
 
-error:
-    if (buf) {
-        free(buf);
+int snmp_recv_pdu_ref(int fd, char *buf, int buf_len, snmp_pdu_t *p, snmp_var_ref_t *refs, int refs_cap) {
+    ssize_t n = _recv(fd, buf, buf_len, p);
+    if (n < 0) {
+        return n;
     }
 
-    return ret;
+    int r = snmp_dec_pdu_ref(buf, n, p, refs, refs_cap);
+    if (r < 0) {
+        return r;
+    }
+
+    return n;
 }
 
-int snmp_send_pdu(int fd, snmp_pdu_t *p) {
-    int ret = -1;
+// snmp_recv_pdu_iter receives a datagram and decodes its header,
+// it then yields varbinds from buf
+int snmp_recv_pdu_iter(int fd, char *buf, int buf_len, snmp_pdu_t *p, snmp_pdu_iter_t *it) {
+    ssize_t n = _recv(fd, buf, buf_len, p);
+    if (n < 0) {
+        *it = (snmp_pdu_iter_t){.pdu = p};
+        return n;
+    }
 
-    p->error = (asn1_error_t){0};
+    int r = snmp_pdu_iter_init(it, buf, n, p);
+    if (r < 0) {
+        return r;
+    }
 
-    int buf_len = 20 * (1 << 10);
-    char *buf = malloc(buf_len);
+    return n;
+}
+
+int snmp_send_pdu(int fd, snmp_pdu_t *p) {
+    int buf_len = 2 * (1 << 10);
+    char *buf = asn1_alloc(NULL, buf_len);
     if (!buf) {
+        p->error = (asn1_error_t){0};
         asn1_set_error(&p->error, -1, "alloc encode buffer");
-        goto error;
+        return -1;
     }
 
-    int m = 0;
-    int r = snmp_enc_pdu(&buf, &m, &buf_len, p);
-    if (r) {
-        goto error;
+    int ret = snmp_send_pdu_buf(fd, &buf, &buf_len, p);
+
+    asn1_release(NULL, buf);
+
+    return ret;
+}
+
+// _renc_msg encodes p into w over buf, growing it as needed up to
+// SNMP_MAX_MSG_SIZE. Values of SNMP_SEND_SEG_MIN bytes or more go to segs.
+static int _renc_msg(asn1_rbuf_t *w, asn1_rbuf_seg_t *segs, char **buf, int *buf_len, snmp_pdu_t *p) {
+    for (;;) {
+        p->error = (asn1_error_t){0};
+
+        asn1_rbuf_init(w, *buf, *buf_len);
+        asn1_rbuf_segs(w, segs, SNMP_SEND_SEGS, SNMP_SEND_SEG_MIN);
+
+        int r = snmp_renc_pdu(w, p);
+        if (r == 0) {
+            break;
+        }
+
+        if (!w->full || *buf_len >= SNMP_MAX_MSG_SIZE) {
+            return -1;
+        }
+
+        int l = *buf_len < 1024 ? 1024 : 2 * *buf_len;
+        if (l > SNMP_MAX_MSG_SIZE) {
+            l = SNMP_MAX_MSG_SIZE;
+        }
+
+        char *b = asn1_realloc(NULL, *buf, 0, l);
+        if (b == NULL) {
+            asn1_set_error(&p->error, -1, "alloc encode buffer");
+            return -1;
+        }
+
+        *buf = b;
+        *buf_len = l;
+    }
+
+    if (w->cap - w->i > SNMP_MAX_MSG_SIZE) {
+        asn1_set_error(&p->error, -1, "message too big");
+        return -1;
     }
 
     // fprintf(stderr, "sending:\n");
-    // _hex_dump(buf, 0, m);
+    // _hex_dump(w->b, w->i, w->cap - w->i);
+
+    return 0;
+}
+
+// _msg_iov points iov at the pieces of the message in w, returns their
+// number. iov must have 2 * SNMP_SEND_SEGS + 1 places.
+static int _msg_iov(const asn1_rbuf_t *w, struct iovec *iov) {
+    asn1_str_t pieces[2 * SNMP_SEND_SEGS + 1];
+
+    int np = asn1_rbuf_pieces(w, pieces, 2 * SNMP_SEND_SEGS + 1);
 
-    ssize_t n = sendto(fd, buf, m, 0, (struct sockaddr *)&p->addr, p->addr_len);
+    for (int j = 0; j < np; j++) {
+        iov[j].iov_base = pieces[j].b;
+        iov[j].iov_len = pieces[j].len;
+    }
+
+    return np;
+}
+
+// snmp_send_pdu_buf encodes headers and small values into buf, values of
+// SNMP_SEND_SEG_MIN bytes or more are sent from where they are.
+int snmp_send_pdu_buf(int fd, char **buf, int *buf_len, snmp_pdu_t *p) {
+    asn1_rbuf_t w;
+    asn1_rbuf_seg_t segs[SNMP_SEND_SEGS];
+
+    if (_renc_msg(&w, segs, buf, buf_len, p)) {
+        return -1;
+    }
+
+    if (w.segs_len == 0) {
+        ssize_t n = sendto(fd, w.b + w.i, w.cap - w.i, 0, (struct sockaddr *)&p->addr, p->addr_len);
+        if (n < 0) {
+            asn1_set_error(&p->error, -1, "sendto");
+            return n;
+        }
+
+        return n;
+    }
+
+    struct iovec iov[2 * SNMP_SEND_SEGS + 1];
+
+    struct msghdr m = {
+        .msg_name = &p->addr,
+        .msg_namelen = p->addr_len,
+        .msg_iov = iov,
+        .msg_iovlen = _msg_iov(&w, iov),
+    };
+
+    ssize_t n = sendmsg(fd, &m, 0);
     if (n < 0) {
-        asn1_set_error(&p->error, -1, "sendto");
-        ret = n;
-        goto error;
+        asn1_set_error(&p->error, -1, "sendmsg");
+        return n;
     }
 
-    ret = n;
+    return n;
+}
 
-error:
-    if (buf) {
-        free(buf);
+int snmp_batch_init(snmp_batch_t *b, int cap, int buf_len) {
+    *b = (snmp_batch_t){.cap = cap, .buf_len = buf_len};
+
+    b->in = calloc(cap, buf_len);
+    b->from = calloc(cap, sizeof(struct sockaddr));
+    b->in_iov = calloc(cap, sizeof(struct iovec));
+    b->in_msgs = calloc(cap, sizeof(struct mmsghdr));
+
+    b->bufs = calloc(cap, sizeof(char *));
+    b->bufs_len = calloc(cap, sizeof(int));
+    b->segs = calloc(cap * SNMP_SEND_SEGS, sizeof(asn1_rbuf_seg_t));
+    b->to = calloc(cap, sizeof(struct sockaddr));
+    b->out_iov = calloc(cap * (2 * SNMP_SEND_SEGS + 1), sizeof(struct iovec));
+    b->out_msgs = calloc(cap, sizeof(struct mmsghdr));
+
+    if (!b->in || !b->from || !b->in_iov || !b->in_msgs || !b->bufs || !b->bufs_len || !b->segs || !b->to ||
+        !b->out_iov || !b->out_msgs) {
+        snmp_batch_free(b);
+        asn1_set_error(&b->error, -1, "alloc batch");
+        return -1;
     }
 
-    return ret;
+    for (int k = 0; k < cap; k++) {
+        b->in_iov[k] = (struct iovec){.iov_base = b->in + (size_t)k * buf_len, .iov_len = buf_len};
+    }
+
+    return 0;
+}
+
+void snmp_batch_free(snmp_batch_t *b) {
+    if (b->bufs) {
+        for (int k = 0; k < b->cap; k++) {
+            asn1_release(NULL, b->bufs[k]);
+        }
+    }
+
+    free(b->in);
+    free(b->from);
+    free(b->in_iov);
+    free(b->in_msgs);
+
+    free(b->bufs);
+    free(b->bufs_len);
+    free(b->segs);
+    free(b->to);
+    free(b->out_iov);
+    free(b->out_msgs);
+
+    *b = (snmp_batch_t){0};
+}
+
+int snmp_recv_batch(int fd, snmp_batch_t *b) {
+    b->error = (asn1_error_t){0};
+    b->len = 0;
+    b->out = 0;
+
+    for (int k = 0; k < b->cap; k++) {
+        b->in_msgs[k] = (struct mmsghdr){.msg_hdr = {
+                                             .msg_name = &b->from[k],
+                                             .msg_namelen = sizeof(struct sockaddr),
+                                             .msg_iov = &b->in_iov[k],
+                                             .msg_iovlen = 1,
+                                         }};
+    }
+
+    int n = recvmmsg(fd, b->in_msgs, b->cap, MSG_WAITFORONE, NULL);
+    if (n < 0) {
+        asn1_set_error(&b->error, -1, "recvmmsg");
+        return n;
+    }
+
+    // a shut down socket gives empty datagrams from nowhere
+    while (n > 0 && b->in_msgs[n - 1].msg_len == 0 && b->in_msgs[n - 1].msg_hdr.msg_namelen == 0) {
+        n--;
+    }
+
+    b->len = n;
+
+    return n;
+}
+
+int snmp_batch_iter(snmp_batch_t *b, int k, snmp_pdu_t *p, snmp_pdu_iter_t *it) {
+    p->error = (asn1_error_t){0};
+
+    p->addr = b->from[k];
+    p->addr_len = b->in_msgs[k].msg_hdr.msg_namelen;
+
+    int r = snmp_pdu_iter_init(it, b->in_iov[k].iov_base, b->in_msgs[k].msg_len, p);
+    if (r < 0) {
+        return r;
+    }
+
+    return b->in_msgs[k].msg_len;
+}
+
+int snmp_batch_add_pdu(snmp_batch_t *b, snmp_pdu_t *p) {
+    if (b->out == b->cap) {
+        p->error = (asn1_error_t){0};
+        asn1_set_error(&p->error, -1, "batch is full");
+        return -1;
+    }
+
+    int k = b->out;
+
+    asn1_rbuf_t w;
+    if (_renc_msg(&w, &b->segs[k * SNMP_SEND_SEGS], &b->bufs[k], &b->bufs_len[k], p)) {
+        return -1;
+    }
+
+    b->to[k] = p->addr;
+
+    struct iovec *iov = &b->out_iov[k * (2 * SNMP_SEND_SEGS + 1)];
+
+    b->out_msgs[k] = (struct mmsghdr){.msg_hdr = {
+                                          .msg_name = &b->to[k],
+                                          .msg_namelen = p->addr_len,
+                                          .msg_iov = iov,
+                                          .msg_iovlen = _msg_iov(&w, iov),
+                                      }};
+
+    b->out++;
+
+    return w.cap - w.i;
+}
+
+int snmp_send_batch(int fd, snmp_batch_t *b) {
+    int sent = 0;
+
+    for (int k = 0; k < b->out;) {
+        int n = sendmmsg(fd, &b->out_msgs[k], b->out - k, 0);
+        if (n < 0) {
+            asn1_set_error(&b->error, -1, "sendmmsg");
+            k++;  // the one failed
+            continue;
+        }
+
+        sent += n;
+        k += n;
+    }
+
+    b->out = 0;
+
+    return sent;
 }
 
 int snmp_dump_packet(int fd) {
@@ -723,62 +1533,48 @@ error:
 }
 
 void snmp_dump_var(snmp_var_t *v) {
-    asn1_dump_oid(v->oid);
+    asn1_dump_oid(&v->oid);
 
     fprintf(stderr, ": (tp %x) ", v->type);
 
-    switch (v->type) {
-    case SNMP_TP_BOOL:
-    case SNMP_TP_INT:
-    case SNMP_TP_COUNTER:
-    case SNMP_TP_GAUGE:
-        fprintf(stderr, "%d", *(int *)v->value);
-        break;
-    case SNMP_TP_COUNTER64:
-    case SNMP_TP_INT64:
-    case SNMP_TP_UINT64:
-    case SNMP_TP_TIMETICKS:
-        fprintf(stderr, "%lld", *(long long *)v->value);
-        break;
-    case SNMP_TP_BIT_STR:
-    case SNMP_TP_OCT_STR:
-        fprintf(stderr, "%s", ((asn1_str_t *)v->value)->b);
-        break;
-    case SNMP_TP_IP_ADDR: {
-        asn1_str_t *str = (asn1_str_t *)v->value;
-        for (int j = 0; j < str->len; j++) {
-            if (j != 0) {
-                fprintf(stderr, ".");
-            }
-            fprintf(stderr, "%d", str->b[j]);
-        }
-        break;
-    }
-    case SNMP_TP_OID:
-        asn1_dump_oid(*(asn1_oid_t *)v->value);
-        break;
-    case SNMP_TP_NULL:
-    case SNMP_TP_NO_SUCH_OBJ:
-    case SNMP_TP_NO_SUCH_INSTANCE:
-    case SNMP_TP_END_OF_MIB_VIEW:
-    default: {
-        asn1_str_t *str = (asn1_str_t *)v->value;
-        if (str) {
-            fprintf(stderr, "null [%x] (%d)", v->type, str->len);
-        } else {
-            fprintf(stderr, "null [%x]", v->type);
-        }
-        break;
+    if (v->enc_value.b) {
+        fprintf(stderr, "(encoded %d bytes)", v->enc_value.len);
+        return;
     }
+
+    const _kind_t *k = _kind(v->type);
+    if (k->dump == NULL) {
+        fprintf(stderr, "[%x] (%d bytes)", v->type, v->value.s.len);
+        return;
     }
+
+    k->dump(v->type, &v->value);
+}
+
+void snmp_dump_var_ref(snmp_var_ref_t *v) {
+    asn1_oid_t id = {0};
+
+    asn1_ref_oid(NULL, v->oid, &id);
+    if (id.len < 0) {
+        fprintf(stderr, "(bad oid)");
+    } else {
+        asn1_dump_oid(&id);
+    }
+
+    asn1_free_oid(&id);
+
+    fprintf(stderr, ": (tp %x) (%d bytes)", v->type, v->value.len);
 }
 
 void snmp_dump_pdu(const char *msg, snmp_pdu_t *p) {
-    fprintf(stderr, "%s: ver %c community %s command %-9s (%x) (%d vars) reqid %x %s %d,%d\n",  //
-            (msg == NULL ? "pdu" : msg), '0' + p->version,                                      //
-            p->community.b, snmp_command_str(p->command), p->command, p->vars_len, p->req_id,   //
-            p->command == SNMP_CMD_GET_BULK ? "max" : "err",                                    //
-            p->command == SNMP_CMD_GET_BULK ? p->max_repeaters : p->error_status,               //
+    int ref = p->flags & SNMP_PDU_REF;
+
+    fprintf(stderr, "%s: ver %c community %.*s command %-9s (%x) (%d vars) reqid %x %s %d,%d\n",  //
+            (msg == NULL ? "pdu" : msg), '0' + p->version,                                        //
+            p->community.len, p->community.b, snmp_command_str(p->command), p->command,           //
+            p->vars_len + p->refs_len, p->req_id,                                                  //
+            p->command == SNMP_CMD_GET_BULK ? "max" : "err",                                      //
+            p->command == SNMP_CMD_GET_BULK ? p->max_repeaters : p->error_status,                 //
             p->command == SNMP_CMD_GET_BULK ? p->max_repetitions : p->error_index);
 
     for (int i = 0; i < p->vars_len; i++) {
@@ -786,6 +1582,12 @@ void snmp_dump_pdu(const char *msg, snmp_pdu_t *p) {
         snmp_dump_var(&p->vars[i]);
         fprintf(stderr, "\n");
     }
+
+    for (int i = 0; ref && i < p->refs_len; i++) {
+        fprintf(stderr, "    ref[%2d]: ", i);
+        snmp_dump_var_ref(&p->refs[i]);
+        fprintf(stderr, "\n");
+    }
 }
 
 const char *snmp_command_str(int c) {
@@ -798,15 +1600,3 @@ const char *snmp_command_str(int c) {
 
     return a[q];
 }
-
-int *snmp_new_int(int v) {
-    int *r = malloc(sizeof(v));
-    *r = v;
-    return r;
-}
-
-long long *snmp_new_long(long long v) {
-    long long *r = malloc(sizeof(v));
-    *r = v;
-    return r;
-}
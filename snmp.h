@@ -6,6 +6,11 @@
 
 #include "asn1.h"
 
+#define SNMP_MAX_MSG_SIZE 65507  // max udp payload
+
+#define SNMP_SEND_SEGS    32   // values sent without copying, per message
+#define SNMP_SEND_SEG_MIN 128  // shorter ones are copied
+
 #define SNMP_VERSION_1  0
 #define SNMP_VERSION_2c 1
 #define SNMP_VERSION_3  3
@@ -51,14 +56,63 @@
 typedef asn1_oid_t snmp_oid_t;
 typedef asn1_str_t snmp_str_t;
 
+#define SNMP_STR_INLINE 16  // string values up to this long are kept inline
+
+// snmp_value_t is a var value kept in the var itself. The var type is the
+// tag telling which member is set:
+//
+//   i    BOOL, INT, COUNTER, GAUGE (the bits of a uint32_t for the last two)
+//   l    COUNTER64, INT64, UINT64, TIMETICKS (of a uint64_t but for INT64)
+//   oid  OID, on the heap (or arena)
+//   s    any other type with contents: up to SNMP_STR_INLINE bytes in s.in,
+//        longer ones in s.ext on the heap (or arena). See snmp_value_str.
+//
+// NULL and the exceptions have no value.
+typedef union {
+    int i;
+    long long l;
+    asn1_oid_t* oid;
+
+    struct {
+        int len;
+        union {
+            char in[SNMP_STR_INLINE];
+            char* ext;
+        };
+    } s;
+} snmp_value_t;
+
+// snmp_value_str views the string value of v, valid while v doesn't move
+static inline snmp_str_t snmp_value_str(const snmp_value_t* v) {
+    snmp_str_t r = {v->s.len > SNMP_STR_INLINE ? v->s.ext : (char*)v->s.in, v->s.len};
+    return r;
+}
+
 typedef struct {
     snmp_oid_t oid;
     int type;
-    void* value;
+    snmp_value_t value;
+
+    // borrowed BER encodings (tag, length and contents) used instead of
+    // oid and value if set. Must outlive the pdu encoding.
+    snmp_str_t enc_oid;
+    snmp_str_t enc_value;
 
     asn1_error_t error;
 } snmp_var_t;
 
+// varbind view decoded by snmp_dec_pdu_ref.
+// oid and value are BER contents pointing into the datagram buffer.
+typedef struct {
+    snmp_str_t oid;
+    int type;
+    snmp_str_t value;
+} snmp_var_ref_t;
+
+#define SNMP_PDU_REF 0x1  // community and refs point into the datagram buffer
+
+typedef struct snmp_pdu_iter snmp_pdu_iter_t;
+
 typedef struct {
     struct sockaddr addr;
     socklen_t addr_len;
@@ -77,31 +131,124 @@ typedef struct {
     int vars_len;
     int vars_cap;
 
+    int flags;
+
+    snmp_var_ref_t* refs;  // caller owned
+    int refs_len;
+    int refs_cap;
+
+    asn1_arena_t* arena;  // if set all the pdu allocations come from it
+
+    snmp_pdu_iter_t* iter;  // set while snmp_pdu_iter_init decodes the header
+
     asn1_error_t error;
 } snmp_pdu_t;
 
+// snmp_pdu_iter yields varbinds of a datagram one by one.
+// The header goes to the pdu as by snmp_dec_pdu_ref, varbinds stay in the
+// buffer until asked for.
+struct snmp_pdu_iter {
+    snmp_pdu_t* pdu;
+
+    const char* b;
+    int i;    // next varbind
+    int end;  // of the varbind list
+
+    snmp_var_ref_t* v;  // being decoded
+};
+
 void snmp_free_var(snmp_var_t* v);
 void snmp_free_var_value(snmp_var_t* v);
 void snmp_free_pdu(snmp_pdu_t* p);
 void snmp_free_pdu_vars(snmp_pdu_t* p);
+void snmp_pdu_free_var_value(snmp_pdu_t* p, snmp_var_t* v);
 
 int snmp_add_error(snmp_pdu_t* p, int code, const char* msg);
 int snmp_set_error_index(snmp_pdu_t* p, int code, int index);
-int snmp_add_var(snmp_pdu_t* p, asn1_oid_t oid, int tp, void* val);
+int snmp_add_var(snmp_pdu_t* p, asn1_oid_t oid, int tp, const snmp_value_t* val);
+
+#define SNMP_BIND_REUSEPORT 0x1  // SO_REUSEPORT, sockets of a port share its datagrams
 
 int snmp_bind(uint32_t addr, int port);
 int snmp_bind_addr(const char* addr);
+int snmp_bind_addr_flags(const char* addr, int flags);
 int snmp_close(int fd);
+int snmp_shutdown(int fd);
+
+int snmp_dec_pdu(const char* buf, int buf_len, snmp_pdu_t* p);
+int snmp_dec_pdu_ref(const char* buf, int buf_len, snmp_pdu_t* p, snmp_var_ref_t* refs, int refs_cap);
+int snmp_enc_pdu(char** buf, int* i, int* buf_len, snmp_pdu_t* p);
+
+// snmp_pdu_iter_next returns 1 and fills v, 0 at the end, -1 on error.
+int snmp_pdu_iter_init(snmp_pdu_iter_t* it, const char* buf, int buf_len, snmp_pdu_t* p);
+int snmp_pdu_iter_next(snmp_pdu_iter_t* it, snmp_var_ref_t* v);
+int snmp_renc_pdu(asn1_rbuf_t* w, snmp_pdu_t* p);
+
+int snmp_enc_value(char** b, int* i, int* l, int tp, const snmp_value_t* val);
+
+// snmp_var_size is the encoded size of v as a varbind, -1 for a bad type
+int snmp_var_size(const snmp_var_t* v);
 
 int snmp_recv_pdu(int fd, snmp_pdu_t* pdu);
+int snmp_recv_pdu_ref(int fd, char* buf, int buf_len, snmp_pdu_t* pdu, snmp_var_ref_t* refs, int refs_cap);
+int snmp_recv_pdu_iter(int fd, char* buf, int buf_len, snmp_pdu_t* pdu, snmp_pdu_iter_t* it);
 int snmp_send_pdu(int fd, snmp_pdu_t* pdu);
 
+// same using caller's buffers, send buffer is a heap one and grows if needed
+int snmp_recv_pdu_buf(int fd, char* buf, int buf_len, snmp_pdu_t* pdu);
+int snmp_send_pdu_buf(int fd, char** buf, int* buf_len, snmp_pdu_t* pdu);
+
+// snmp_batch_t takes up to cap datagrams with one recvmmsg and sends the
+// responses with one sendmmsg. Datagram k is read with snmp_batch_iter,
+// its response is queued by snmp_batch_add_pdu and encoded as by
+// snmp_send_pdu_buf, so the values it references must stay until
+// snmp_send_batch.
+typedef struct {
+    int cap;
+    int buf_len;  // of a datagram
+
+    int len;  // received
+    int out;  // responses queued
+
+    char* in;               // cap buffers of buf_len
+    struct sockaddr* from;  // of each datagram
+    struct iovec* in_iov;
+    struct mmsghdr* in_msgs;
+
+    char** bufs;  // encode buffers of each response, grown as needed
+    int* bufs_len;
+    asn1_rbuf_seg_t* segs;  // SNMP_SEND_SEGS per response
+    struct sockaddr* to;
+    struct iovec* out_iov;  // 2 * SNMP_SEND_SEGS + 1 per response
+    struct mmsghdr* out_msgs;
+
+    asn1_error_t error;
+} snmp_batch_t;
+
+int snmp_batch_init(snmp_batch_t* b, int cap, int buf_len);
+void snmp_batch_free(snmp_batch_t* b);
+
+// snmp_recv_batch waits for a datagram and takes the ones already there,
+// up to cap. Returns their number, 0 once fd is shut down, or -1.
+int snmp_recv_batch(int fd, snmp_batch_t* b);
+
+// snmp_batch_iter is snmp_recv_pdu_iter for datagram k of the batch
+int snmp_batch_iter(snmp_batch_t* b, int k, snmp_pdu_t* p, snmp_pdu_iter_t* it);
+int snmp_batch_add_pdu(snmp_batch_t* b, snmp_pdu_t* p);
+
+// snmp_send_batch sends the queued responses and empties the queue.
+// Returns the number sent, a response failing is skipped and leaves the
+// error in b.
+int snmp_send_batch(int fd, snmp_batch_t* b);
+
 int snmp_dump_packet(int fd);
 
 void snmp_dump_pdu(const char* msg, snmp_pdu_t* p);
+void snmp_dump_var_ref(snmp_var_ref_t* v);
 
 const char* snmp_command_str(int c);
 
-int* snmp_new_int(int v);
-
-long long* snmp_new_long(long long v);
+// snmp_arena_set_* copy the value into v, the storage is taken from a
+// (the heap if NULL) unless it fits inline. Numbers are set directly.
+int snmp_arena_set_str(asn1_arena_t* a, snmp_value_t* v, const char* s, int len);
+int snmp_arena_set_oid(asn1_arena_t* a, snmp_value_t* v, const uint32_t* arcs, int len);